@@ -5,14 +5,15 @@ for the limit and output file name,and it will generate a sieve of Eratosthenes
 If no output file name is provided, it will print the prime numbers to the standard output (terminal).
 It also includes a help message that can be displayed by using the -h or --help flag.
 
-This code is written in C and adheres to the C17 standard.
+This code is written in C and adheres to the C17 standard, using the GCC/Clang __int128 type for large prefix sums.
 It includes error handling for memory allocation and input validation.
 The sieve is implemented using an array, and the prime numbers are printed or written to a CSV file.
 
 Compilation instructions:
 To compile this code, use the following command:
-gcc -std=c17 -o eratos3 eratos3.c -lm
-This command compiles the code with the C17 standard and links the math library for the sqrt function.
+gcc -std=c17 -pthread -o eratos3 eratos3.c -lm
+This command compiles the code with the C17 standard, enables POSIX threads for the segmented sieve
+and links the math library for the sqrt function.
 
 This project is maintained by Malloc83.
 This code was written between 26.07.2025 and 31.07.2025.
@@ -23,6 +24,7 @@ This code is licensed under the MIT License.
 You are free to use, modify, and distribute this code as long as you include the original license and copyright notice.
 */
 
+#define _GNU_SOURCE // For the POSIX and Linux functions used to detect memory
 #include <stdio.h>  // For printf and scanf
 #include <stdlib.h> // For malloc, free and atoi
 #include <limits.h> // For UINT_MAX
@@ -31,45 +33,603 @@ You are free to use, modify, and distribute this code as long as you include the
 #include <errno.h> // For error handling
 #include <string.h> // For string manipulation functions
 #include <ctype.h> // For tolower function
+#include <stdint.h> // For fixed width integer types used by the bitmaps
+#include <unistd.h> // For sysconf
+#include <sys/mman.h> // For mmap and madvise of huge page backed buffers
+#include <pthread.h> // For the worker threads of the segmented sieve
+#include <stdatomic.h> // For the allocation counters shared by the worker threads
+#include <sys/resource.h> // For getrusage, peak memory and page faults
+#include <time.h> // For clock_gettime, the monotonic clock of the benchmarks
+#include <sys/syscall.h> // For the perf_event_open system call
+#include <linux/perf_event.h> // For the hardware performance counters of --counters
+#include <fcntl.h> // For open with O_DIRECT in the output benchmark
+#include <sys/stat.h> // For the size of the files written by the output benchmark
+#include <signal.h> // For progress reports on SIGUSR1
+#include <sched.h> // For sched_getaffinity and the CPU sets of pinned threads
+#include <sys/wait.h> // For waitpid in the startup benchmark
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h> // For the USDT probes, from systemtap-sdt-dev(el)
+#endif
+#endif
 
 //  Define constants for the maximum limit and prime status
 #define MAX_LIMIT UINT_MAX  // Define the maximum limit for prime number generation (unsigned int)
-#define IS_PRIME 1
-#define NOT_PRIME 0 
+#define MAX_STREAM_LIMIT 10000000000000000000ULL // Maximum limit when the primes are streamed by the segmented sieve (1e19)
+#define MAX_NTH_INDEX 10000000000000ULL // Largest index of --nth (1e13), the prime is about 3.2e14
+#define MAX_SUM_LIMIT 100000000000000ULL // Maximum limit for the prefix sums of multiplicative functions (1e14)
+#define LINEAR_CHECK_LIMIT 1000000 // --verify cross-checks prefix sums up to this limit with the linear sieve
+#define IS_PRIME 0  // Zero means still a candidate, so zero filled memory is an initialized sieve
+#define NOT_PRIME 1 // Crossed out
 #define ERROR -1
 #define EXIT_SUCCESS 0
 #define EXIT_FAILURE 1 
 #define EXIT_HELP 2
+#define MODE_PRIMES 0   // List all primes up to the limit
+#define MODE_SAFE 1     // List safe primes p up to the limit, (p-1)/2 is also prime
+#define MODE_GERMAIN 2  // List Sophie Germain primes q up to the limit, 2q+1 is also prime
+#define SEGMENT_BITS (1u << 18) // Bits per bitmap segment (32 KiB), small enough to stay in cache
+#define SUM_NONE 0      // No prefix sum requested
+#define SUM_MU 1        // Mertens function M(x), sum of the Moebius function
+#define SUM_PHI 2       // Summatory totient, sum of Euler's phi function
+#define SUM_DIVISORS 3  // Sum of the number of divisors d(n)
+#define SUM_SIGMA 4     // Sum of the sum of divisors sigma(n)
+
+#define ENGINE_NONE 0      // No engine fits in the memory budget
+#define ENGINE_FLAT 1      // One array for the full range, as in sieve_of_eratosthenes
+#define ENGINE_SEGMENTED 2 // Bitmap segments of odd numbers sieved by worker threads, written out in order
+#define ENGINE_SMALL 3     // Byte sieve in static memory for small limits, the fast path
+#define ENGINE_PAIRED 4    // Paired bitmaps of odd numbers for safe and Sophie Germain primes
+#define ENGINE_PI 5        // Prime counting function of Lucy, counts without sieving the range
+#define ENGINE_WINDOW 6    // Prime count near an estimate of the n-th prime, then a sieve of the window up to it
+#define ENGINE_TEST 7      // Miller-Rabin test of a single number
+#define ENGINE_BITMAP 8    // Segments sieved by worker threads into a preallocated bitmap file
+
+#define QUERY_LIST 0       // List the primes up to the limit, from --range if given
+#define QUERY_COUNT 1      // Count the primes up to the limit, from --range if given (--count)
+#define QUERY_NTH 2        // Find the n-th prime (--nth)
+#define QUERY_IS_PRIME 3   // Test whether one number is prime (--is-prime)
+#define QUERY_BITMAP 4     // Write the bitmap of the range to a file (--bitmap)
+#define BLOCK_SEGMENTS 16 // Segments per block, the unit of work of one worker thread
+#define BUCKET_ENTRIES 1024 // Large prime entries per bucket block
+#define OUTPUT_CHUNK (64u << 10) // Size of one chunk of formatted output text (64 KiB)
+#define ARENA_CHUNK (1u << 20) // Minimum size of an arena chunk (1 MiB)
+#define POOL_SLAB_BLOCKS 16 // Blocks allocated at once when a pool runs empty
+#define CACHE_LINE 64 // Alignment of arena and pool memory
+#define MAX_THREADS 1024 // Maximum number of worker threads
+#define PREFETCH_DISTANCE 16 // Bucket entries between a prefetch and its use, 0 disables prefetching
+#define MAX_PREFETCH 1024 // Maximum prefetch distance
+#define STAT_BASE 0     // Allocations for the sieving primes
+#define STAT_SIEVE 1    // Allocation of the full sieve array
+#define STAT_SEGMENTS 2 // Segments, medium primes and bucket heads (worker arenas)
+#define STAT_BUCKETS 3  // Bucket blocks of the large primes
+#define STAT_OUTPUT 4   // Output file buffer and text chunks
+#define STAT_SUMS 5     // Tables of the prefix sums
+#define STAT_COUNT 6    // Number of allocation categories
+#define TIME_PARSE 0    // Timing phase: argument parsing
+#define TIME_INIT 1     // Timing phase: allocation and setup of the sieve, sink and workers
+#define TIME_BASE 2     // Timing phase: sieving primes up to the square root
+#define TIME_SIEVE 3    // Timing phase: crossing off
+#define TIME_EXTRACT 4  // Timing phase: counting the primes of a bitmap
+#define TIME_FORMAT 5   // Timing phase: finding the primes and formatting them as text
+#define TIME_IO 6       // Timing phase: writing the text and closing the output
+#define TIME_COUNT 7    // Number of timing phases
+#define KERNEL_MEDIUM 0 // Kernel of the segmented sieve: medium primes crossing off every segment
+#define KERNEL_BUCKET 1 // Kernel of the segmented sieve: large primes taken from the buckets
+#define KERNEL_COUNT 2  // Number of measured kernels
+#define EVENT_CYCLES 0  // Counter: processor cycles
+#define EVENT_INSTRUCTIONS 1 // Counter: retired instructions
+#define EVENT_L1D_MISSES 2 // Counter: L1 data cache read misses
+#define EVENT_LLC_MISSES 3 // Counter: last level cache misses
+#define EVENT_BRANCH_MISSES 4 // Counter: mispredicted branches
+#define EVENT_DTLB_MISSES 5 // Counter: data TLB read misses
+#define EVENT_COUNT 6   // Number of hardware counters
+#define TRACE_MAX_EVENTS (1u << 20) // Events kept per thread by --trace, later ones are counted as dropped
+#define PROGRESS_TICK 0.1 // Seconds between two looks of the progress reporter at the clock and SIGUSR1
+#define BENCH_REPS 5    // Default repetitions per benchmark case
+#define MAX_BENCH_REPS 1000 // Maximum repetitions per benchmark case
+#define BENCH_TOP 1000000000ULL // Default largest benchmark limit (1e9), raise with -n up to 1e11 and beyond
+#define BENCH_RESAMPLES 2000 // Bootstrap resamples for the confidence intervals
+#define FAST_PATH_LIMIT 1000000 // Limits up to this are sieved in static memory, without planning or mapping
+#define FAST_PATH_TEXT 65536 // Text buffer of the small-limit fast path
+#define FAST_PATH_PRIMES 78498 // Primes up to FAST_PATH_LIMIT, the n-th prime up to here comes from a small sieve
+#define SIEVE_NS 2.0 // Time of the counting segmented sieve per number and thread in ns, measured
+#define PI_NS 5.0 // Time of one step of the prime counting function in ns, measured
+#define PI_STEPS 11.4 // Steps of the prime counting function are about PI_STEPS * x^(3/4) / ln x
+#define STARTUP_VARIANTS 6 // Ways of starting the program measured by --startup
+#define SCALE_LIMIT 1000000000ULL // Default range of --scale (1e9)
+#define VERIFY_LIMIT 1000000000ULL // Default range of --verify (1e9)
+#define VERIFY_REPORT 10 // Mismatching segments listed by --verify
+#define VERIFY_PLAN_BUDGET (6ULL << 30) // Budget in which --verify expects a stream up to MAX_STREAM_LIMIT to fit (6 GiB)
+#define REGRESS_THRESHOLD 5.0 // Default slowdown in percent that counts as a regression
+#define REGRESS_ALPHA 0.05 // Significance level of the Mann-Whitney U test
+#define MICRO_BITS (1u << 24) // Bits crossed off per microbenchmark run, at least 16 segments
+#define MICRO_MIN_SEGMENT 8192 // Smallest segment size of the microbenchmark in bytes
+#define MICRO_MAX_SEGMENT (1u << 20) // Largest segment size of the microbenchmark in bytes
+#define SMALL_PRIME_MAX 64 // Primes below this hit every 64-bit word at least once
+#define OUTBENCH_LIMIT 100000000ULL // Default limit of the prime sequence of the output benchmark (1e8)
+#define OUTBENCH_FILE "eratos3-outbench.tmp" // Scratch file of the output benchmark, removed afterwards
+#define DIRECT_ALIGN 4096 // Alignment of buffers, offsets and sizes for O_DIRECT
+#define BITMAP_SEGMENT (1u << 20) // Bytes per segment of the bitmap file (8 Mi odd numbers), one index entry each
+#define BITMAP_MAGIC "ERATOS3B" // First 8 bytes of a complete bitmap file
+#define BITMAP_VERSION 1 // Layout version of the bitmap file
+#define MMAP_WINDOW (64u << 20) // Part of the output file mapped at a time by the mmap writer
+#define FORMAT_FPRINTF 0 // Formatter: fprintf, as the full sieve writes
+#define FORMAT_DIGITS 1  // Formatter: digit loop of the segmented sieve (format_u64)
+#define FORMAT_TABLE 2   // Formatter: two digits at a time from a table
+#define FORMAT_INCREMENT 3 // Formatter: add the gap to the text of the previous number
+#define FORMAT_COUNT 4   // Number of formatters
+#define WRITER_NONE 0    // Writer: none, only formatting into memory
+#define WRITER_STDIO 1   // Writer: fwrite to a fully buffered stream
+#define WRITER_WRITE 2   // Writer: write system calls
+#define WRITER_MMAP 3    // Writer: memcpy into a shared file mapping
+#define WRITER_DIRECT 4  // Writer: write with O_DIRECT, bypassing the page cache
+#define WRITER_COUNT 5   // Number of writers
+#define OUTPUT_BUFFER (1u << 20) // Default size of the output file buffer (1 MiB)
+#define MIN_BUFFER 4096 // Smallest segment and output buffer the planner will use
+#define MAX_SEGMENT (1u << 28) // Largest segment (256 MiB), so bit offsets in a segment fit in 32 bits
+#define HUGE_PAGE_SIZE (2u << 20) // Buffers of at least this size are backed by huge pages when possible
+#define BACKING_MALLOC 0   // Allocated with malloc, small buffers or when mmap fails
+#define BACKING_PAGES 1    // Anonymous mmap with normal 4 KiB pages, huge pages were refused
+#define BACKING_THP 2      // Anonymous mmap advised to use transparent huge pages
+#define BACKING_HUGE_2M 3  // hugetlbfs mapping with 2 MiB pages (--hugepages)
+#define BACKING_HUGE_1G 4  // hugetlbfs mapping with 1 GiB pages (--hugepages)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#ifndef CGROUP_ROOT
+#define CGROUP_ROOT "/sys/fs/cgroup" // Mount point of the cgroup file systems
+#endif
+
+// USDT probes of provider eratos3, a nop instruction each until a tracer attaches. Without sys/sdt.h,
+// or built with -DNO_PROBES, they only evaluate their arguments, which are plain variables
+#if defined(DTRACE_PROBE3) && !defined(NO_PROBES)
+#define PROBE1(name, a) DTRACE_PROBE1(eratos3, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(eratos3, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(eratos3, name, a, b, c)
+#else
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
+typedef __int128 wide_t; // Signed 128-bit integer for prefix sums that overflow 64 bits
+
+// Large buffer, possibly backed by huge pages
+typedef struct {
+    void *ptr;        // Start of the usable memory
+    size_t size;      // Requested size in bytes
+    size_t mapped;    // Size of the mapping, 0 when allocated with malloc
+    int backing;      // How the memory is backed, see BACKING_* constants
+    const char *name; // Name used in the backing report
+    int category;     // Allocation category for --stats, see STAT_* constants
+} big_buffer;
+
+// Output sink, writes numbers separated by sep to a stream, or only counts them when fp is NULL
+typedef struct {
+    FILE *fp;                 // Destination stream (stdout or the CSV file)
+    big_buffer buffer;        // Buffer of the output file
+    char sep;                 // Separator written between two numbers
+    int first;                // Non-zero until the first number is written
+    unsigned long long count; // Amount of numbers written
+} prime_sink;
+
+// Execution plan chosen by plan_sieve for the memory budget
+typedef struct {
+    int engine;           // ENGINE_FLAT or ENGINE_SEGMENTED, ENGINE_NONE if nothing fits
+    size_t segment_bytes; // Size of one bitmap segment
+    size_t buffers;       // Number of blocks in flight, the pipeline depth
+    size_t output_buffer; // Size of the output file buffer
+    size_t memory;        // Estimated peak memory of the plan in bytes
+    size_t threads;       // Number of worker threads
+    size_t block_segments; // Segments per block of one worker
+    size_t prefetch;      // Prefetch distance in the bucket loop
+    uint64_t low;         // Smallest number of the range, 0 to start at the beginning
+} sieve_plan;
+
+// Processors and memory this process may use, read once by detect_resources
+typedef struct {
+    int version;          // cgroup version the limits came from, 0 if none applies
+    size_t online;        // Processors online in the system
+    size_t affinity;      // Processors in the affinity mask, which follows cpuset.cpus.effective
+    size_t cpuset;        // Processors in cpuset.cpus.effective, 0 if unknown
+    double quota;         // CPU quota of cpu.max in processors, 0 if unlimited
+    size_t cpus;          // Processors for the worker threads, the smallest of the above
+    size_t memory_limit;  // Lowest memory.max or memory.high on the path to the root, SIZE_MAX if none
+    size_t memory_left;   // Room left under the limits, without reclaimable file pages, SIZE_MAX if none
+} resource_limits;
+
+// Chunk of an arena, the memory follows the header
+typedef struct arena_chunk {
+    struct arena_chunk *next; // Next chunk of the arena
+    size_t size;              // Usable bytes
+    size_t used;              // Bytes handed out since the last reset
+} arena_chunk;
+
+// Bump allocator, reset in bulk per block
+typedef struct {
+    arena_chunk *first;   // First chunk
+    arena_chunk *current; // Chunk allocations are taken from
+    size_t allocated;     // Bytes of all chunks
+} arena;
+
+// Free block in a pool, the link is stored in the block itself
+typedef struct free_block {
+    struct free_block *next;
+} free_block;
+
+// Slab of pool blocks, the blocks follow the header
+typedef struct pool_slab {
+    struct pool_slab *next;
+} pool_slab;
+
+// Allocator for blocks of one size, recycled through a free list
+typedef struct {
+    size_t block_size;     // Size of each block, a multiple of CACHE_LINE
+    free_block *free_list; // Blocks ready for use
+    pool_slab *slabs;      // All slabs, freed at the end
+    size_t allocated;      // Bytes of all slabs
+    int category;          // Allocation category for --stats
+} block_pool;
+
+/* Sieving state of a medium prime, which crosses off at least once in every segment.
+ * Packed in 8 bytes: the prime is below segment_bits and the offset is relative to the segment,
+ * so both stay below 2^32 as long as segment_bits does. */
+typedef struct {
+    uint32_t prime;  // Sieving prime, also the step in the odd-only bitmap
+    uint32_t offset; // Bit of its next odd multiple, relative to the start of the current segment
+} medium_prime;
+
+// Sieving state of a large prime, kept in the bucket of the segment of its next multiple (8 bytes)
+typedef struct {
+    uint32_t prime;  // Sieving prime, below 2^32 as the limit is below 2^64
+    uint32_t offset; // Bit of its next odd multiple within the segment of the bucket
+} bucket_entry;
+
+// Bucket block, buckets are lists of these
+typedef struct bucket_block {
+    struct bucket_block *next;            // Next block of the same bucket
+    size_t used;                          // Entries in use
+    bucket_entry entries[BUCKET_ENTRIES]; // Large primes
+} bucket_block;
+
+// Chunk of formatted output text
+typedef struct out_chunk {
+    struct out_chunk *next; // Next chunk of the same block
+    size_t used;            // Bytes of text
+    char text[];            // OUTPUT_CHUNK bytes
+} out_chunk;
+
+// Hardware counters of one thread, read together as a perf_event group
+typedef struct {
+    int fd[EVENT_COUNT];   // File descriptor per event, the first open one leads the group
+    int slot[EVENT_COUNT]; // Position of the event in a group read, -1 if it could not be opened
+    int leader;            // File descriptor of the group leader
+    int opened;            // Number of events in the group, 0 if counting is off or unavailable
+} counter_group;
+
+// Point in time and counter values, or the sum of the differences of such points for a phase
+typedef struct {
+    double seconds;                  // Monotonic clock
+    unsigned long long events[EVENT_COUNT]; // Counter values, scaled when the group was multiplexed
+} phase_mark;
+
+// Samples of one benchmark case, identified by limit, engine, threads and segment size
+typedef struct {
+    unsigned long long limit;        // Limit of the case
+    char engine[16];                 // Engine name
+    size_t threads;                  // Worker threads
+    size_t segment_bytes;            // Segment size, 0 for the full sieve
+    int reps;                        // Number of samples
+    double samples[MAX_BENCH_REPS];  // Wall time of every repetition in seconds
+} bench_result;
+
+// Header at the start of a bitmap file (--bitmap), little endian on the usual hosts. Bit i of the
+// bitmap, bit i % 8 of byte i / 8, is set when the odd number first + 2i is prime
+typedef struct {
+    char magic[8];          // BITMAP_MAGIC, only written once the file is complete
+    uint32_t version;       // BITMAP_VERSION
+    uint32_t header_bytes;  // Size of this header, the index follows it
+    uint64_t first;         // Odd number of bit 0
+    uint64_t limit;         // Largest number of the range
+    uint64_t bits;          // Odd numbers in the bitmap
+    uint64_t segment_bits;  // Bits per index entry
+    uint64_t segments;      // Segments, the index has one more entry
+    uint64_t index_offset;  // File offset of the index
+    uint64_t data_offset;   // File offset of the bitmap, a multiple of DIRECT_ALIGN
+    uint64_t primes;        // Odd primes in the bitmap, 2 is not in it
+} bitmap_header;
+
+// One segment of the bitmap file, sieved by a worker thread
+typedef struct {
+    uint64_t first;   // Index of the odd number of bit 0
+    size_t nbits;     // Bits of the segment
+    size_t bytes;     // Size of the buffer
+    uint64_t *bits;   // Set bits are the primes
+    uint64_t primes;  // Primes in the segment
+    double seconds;   // Time to sieve the segment, for --timing
+} bitmap_job;
+
+// Output file of the output benchmark, written through one of the WRITER_* backends
+typedef struct {
+    int kind;          // Which WRITER_* backend
+    int fd;            // File descriptor
+    FILE *fp;          // Stream of WRITER_STDIO
+    char *map;         // Mapped window of WRITER_MMAP
+    size_t map_start;  // File offset of the mapped window
+    size_t written;    // Bytes written so far
+} out_writer;
+
+// Complete event of the trace, a phase of one thread from start to end
+typedef struct {
+    double start;   // Monotonic clock at the start
+    double end;     // Monotonic clock at the end
+    uint64_t first; // First number of the segment, 0 for events of the main thread
+    int phase;      // Which TIME_* phase
+} trace_event;
+
+// Trace events of one thread; only one thread appends at a time, so no locking is needed
+typedef struct {
+    trace_event *events; // Events in the order they ended
+    size_t count;        // Number of events
+    size_t capacity;     // Allocated events
+    size_t dropped;      // Events not kept after TRACE_MAX_EVENTS
+} trace_buffer;
+
+// Segments finished by one worker, on a cache line of its own so the workers never share one
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_ullong segments; // Only written by its worker, with relaxed increments
+} progress_slot;
+
+// Thread that reports the progress of the segmented sieve on a timer and on SIGUSR1
+typedef struct {
+    progress_slot *slots;        // One slot per worker
+    size_t threads;              // Number of slots
+    unsigned long long total;    // Segments of the whole range
+    uint64_t segment_bits;       // Odd numbers per segment
+    double started;              // Monotonic clock at the start of sieving
+    double interval;             // Seconds between reports, 0 for reports on SIGUSR1 only
+    atomic_int stop;             // Set by sieve_segmented when all blocks are done
+} progress_reporter;
+
+// Worker thread of the segmented sieve, with its own memory so threads never share an allocator
+typedef struct {
+    const sieve_plan *plan; // Plan of the run
+    uint64_t first;         // Index of the first odd number of the current block
+    uint64_t end;           // Index one past the last odd number of the current block
+    char sep;               // Separator written before each number
+    arena mem;              // Segment, medium primes and bucket heads of the block
+    block_pool buckets;     // Bucket blocks
+    block_pool chunks;      // Output text chunks
+    out_chunk *out_head;    // Text of the block
+    out_chunk *out_tail;    // Chunk being filled
+    unsigned long long count; // Primes found in the block
+    out_chunk *done_head;   // Text of the previous block, being written out
+    unsigned long long done_count; // Primes found in the previous block
+    int failed;             // Non-zero if memory ran out
+    int count_only;         // Count the primes without formatting them
+    phase_mark time[TIME_COUNT]; // Time and counters per phase over all blocks
+    phase_mark kernel[KERNEL_COUNT]; // Time and counters per sieving kernel over all blocks
+    counter_group counters; // Hardware counters of the thread sieving the current block
+    size_t blocks;          // Blocks sieved
+    progress_slot *progress; // Counter of finished segments, NULL without progress reports
+    trace_buffer *trace;    // Trace events of the worker, NULL without --trace
+    uint64_t *digests;      // Digest of every segment of the range for --verify, NULL otherwise
+    unsigned long long bucket_entries; // Large prime entries crossed off, over all blocks
+} sieve_worker;
 
 // Global variables
 int *sieve; // Array to hold the sieve of Eratosthenes
+big_buffer sieve_buffer; // Memory behind the sieve array
+int use_hugetlb = 0; // Request hugetlbfs pages for large buffers (--hugepages)
+int show_stats = 0; // Report memory statistics at exit (--stats)
+const char *stats_json = NULL; // File for the memory statistics in JSON (--stats-json)
+atomic_size_t stat_allocated[STAT_COUNT]; // Bytes allocated per category, including freed ones
+atomic_size_t stat_live[STAT_COUNT]; // Bytes allocated and not yet freed per category
+atomic_size_t stat_peak[STAT_COUNT]; // Largest value of stat_live per category
+atomic_size_t stat_calls[STAT_COUNT]; // Number of allocations per category
+double progress_interval = -1; // Seconds between progress reports, 0 for SIGUSR1 only, negative for none (--progress)
+volatile sig_atomic_t progress_requested = 0; // Set by the SIGUSR1 handler
+volatile sig_atomic_t progress_active = 0; // Set while the progress reporter of the segmented sieve runs
+const char *trace_file = NULL; // File for the Chrome trace of the run (--trace)
+trace_buffer trace_threads[MAX_THREADS + 1]; // Trace events of the main thread (0) and of every worker
+static const char *phase_names[TIME_COUNT] = { "parse", "initialization", "base_primes", "sieving",
+                                               "extraction", "formatting", "io" };
+int show_timing = 0; // Report the time of every phase at exit (--timing)
+double program_start = 0; // Monotonic clock at the start of main
+phase_mark phase_total[TIME_COUNT]; // Time and counters per phase, summed over the threads
+phase_mark kernel_total[KERNEL_COUNT]; // Time and counters per sieving kernel, summed over the threads
+int use_counters = 0; // Read the hardware counters around every phase and kernel (--counters)
+counter_group main_counters; // Hardware counters of the main thread
+const char *counters_error = NULL; // Why the hardware counters are unavailable
+double thread_time[MAX_THREADS][TIME_COUNT]; // Seconds per phase of every worker thread
+size_t thread_blocks[MAX_THREADS]; // Blocks sieved by every worker thread
+size_t timed_threads = 0; // Worker threads of the last segmented run
+int fast_path = 1; // Use the small-limit fast path, switched off with --no-fast-path
+int startup_mode = 0; // Measure the latency of whole program runs (--startup)
+int scale_mode = 0; // Measure the speedup of the segmented sieve over the thread count (--scale)
+int pin_threads = 0; // Pin worker t to the t-th allowed processor (--pin)
+int skip_smt = 0; // Use only the first hardware thread of every core when pinning (--no-smt)
+int pin_cpus[MAX_THREADS]; // Processors the workers are pinned to
+size_t pin_count = 0; // Number of entries in pin_cpus, 0 means no pinning
+unsigned long long bucket_total = 0; // Large prime entries crossed off by all segmented runs
+int verify_mode = 0; // Check the engines against known values and each other (--verify)
+uint64_t *verify_digests = NULL; // Segment digests the segmented sieve records for --verify
+int outbench_mode = 0; // Run the output benchmark instead of listing primes (--outbench)
+int micro_mode = 0; // Run the kernel microbenchmark instead of listing primes (--microbench)
+int bench_mode = 0; // Run the benchmark instead of listing primes (--bench)
+int bench_reps = BENCH_REPS; // Repetitions per benchmark case (--reps)
+const char *bench_json = NULL; // File for the benchmark results in JSON (--bench-json)
+const char *baseline_json = NULL; // Benchmark results to compare with, written by --bench-json (--baseline)
+double regress_threshold = REGRESS_THRESHOLD; // Slowdown in percent that fails the comparison (--threshold)
+int verbose = 0; // Report memory backing and other details on stderr (--verbose)
 char* file_out = NULL; // Output file name
-unsigned limit = 0; // Limit for prime number generation
+unsigned long long limit = 0; // Limit for prime number generation
+int stream_output = 0; // Always use the segmented sieve, also when the full sieve fits (--stream)
+int prefetch_distance = PREFETCH_DISTANCE; // Prefetch distance in the bucket loop (--prefetch)
+size_t segment_size = 0; // Segment size in bytes set with --segment, 0 means SEGMENT_BITS / 8
+int thread_count = 0; // Worker threads set with -t, 0 means one per processor
+size_t memory_budget = 0; // Memory budget in bytes set with -m, 0 means detect the available memory
+int sum_function = SUM_NONE; // Which prefix sum is computed, see SUM_* constants
+int query = QUERY_LIST; // What is asked for, see QUERY_* constants
+unsigned long long range_low = 0; // Smallest number of --range, 0 for the whole range
+unsigned long long query_number = 0; // Index of --nth or number of --is-prime
+int explain = 0; // Print the plan instead of running it (--explain)
+const char *bitmap_file = NULL; // File of --bitmap
+int prime_mode = MODE_PRIMES; // Which primes are listed, see MODE_* constants
+uint32_t *base_primes = NULL; // Sieving primes up to the square root of the range
+size_t base_count = 0; // Number of entries in base_primes
 
 // Function prototypes
 int read_cmnd_arg(int argc, char* argv[]);  // Function to read command line arguments
 void print_help(); // Function to print help message
-void initialize_sieve(unsigned limit); // Function to initialize the sieve
+int initialize_sieve(unsigned limit); // Function to initialize the sieve
 void sieve_of_eratosthenes(unsigned limit); // Function to perform the Sieve of Eratosthenes algorithm
 void print_primes(unsigned limit); // Function to print the prime numbers found in the sieve
 void write_sieve_to_csv(const char *filename, unsigned limit); // Function to write the sieve to a CSV file
 void free_sieve(); // Function to free the allocated memory for the sieve
+uint64_t isqrt_u64(uint64_t n); // Function to compute the integer square root
+uint64_t prime_count_bound(uint64_t x); // Function to bound the number of primes up to x from above
+int generate_base_primes(uint64_t bound); // Function to collect the sieving primes up to bound
+void sieve_odd_segment(uint64_t *bits, uint64_t first, size_t nbits); // Function to sieve a segment of odd numbers
+void sieve_all_segment(uint64_t *bits, uint64_t first, size_t nbits); // Function to sieve a segment of all numbers
+int sieve_safe_primes(unsigned limit, int mode, prime_sink *sink); // Function to find safe or Sophie Germain primes
+void sink_put(prime_sink *sink, uint64_t value); // Function to write a number to the output sink
+int parse_limit(const char *text, unsigned long long *value); // Function to parse an integer such as 1000 or 1e12
+unsigned long long max_limit(); // Function to get the maximum limit for the selected mode
+int run_prefix_sum(unsigned long long x); // Function to compute and report the selected prefix sum
+int prefix_sum_min25(int fn, uint64_t x, wide_t *sum); // Function to compute a prefix sum with the min_25 sieve
+int prefix_sum_linear(int fn, uint64_t x, wide_t *sum); // Function to compute a prefix sum with the linear sieve
+wide_t prime_power_value(int fn, uint64_t p, uint64_t pe, int e); // Function to evaluate f(p^e)
+char *format_wide(wide_t value, char *buf); // Function to format a 128-bit integer as decimal text
+int parse_size(const char *text, size_t *value); // Function to parse a size such as 512M or 2G
+size_t detect_available_memory(); // Function to read the memory available to this process
+sieve_plan plan_sieve(unsigned long long limit, size_t budget); // Function to choose the engine for the budget
+sieve_plan plan_query(unsigned long long limit); // Function to choose the engine for the query
+void explain_plan(const sieve_plan *plan, unsigned long long limit); // Function to print the plan of a query
+int run_query(const sieve_plan *plan, unsigned long long limit); // Function to answer a count, n-th prime or primality query
+int prime_count(uint64_t x, uint64_t *count); // Function to count the primes up to x without sieving
+double prime_count_steps(uint64_t x); // Function to estimate the steps of prime_count
+int nth_prime(uint64_t n, uint64_t *prime); // Function to find the n-th prime
+int is_prime_u64(uint64_t n); // Function to test a number with Miller-Rabin
+int write_bitmap(const sieve_plan *plan, unsigned long long limit); // Function to sieve the range into a bitmap file
+void *bitmap_segment(void *arg); // Function to sieve one segment of the bitmap file, the entry point of its workers
+int sieve_segmented(unsigned long long limit, const sieve_plan *plan, prime_sink *sink); // Function to sieve segment by segment
+size_t worker_memory(const sieve_plan *plan, unsigned long long limit); // Function to estimate the memory of one worker
+size_t detect_cpu_count(); // Function to count the available processors
+const resource_limits *detect_resources(); // Function to read the processor and memory limits of the cgroup
+void *sieve_block(void *arg); // Function to sieve one block, the entry point of the worker threads
+int bucket_push(sieve_worker *w, bucket_block **bucket, uint32_t prime, uint32_t offset); // Function to add a large prime to a bucket
+void sieve_medium(uint64_t *bits, size_t nbits, medium_prime *medium, size_t count); // Function to cross off the medium primes of a segment
+int sieve_bucket(sieve_worker *w, uint64_t *bits, bucket_block **bucket, size_t s, int shift, uint64_t block_bits); // Function to cross off the large primes of a segment
+size_t format_u64(char *text, uint64_t value); // Function to format a number as decimal text
+void *arena_alloc(arena *a, size_t size); // Function to allocate from an arena
+void arena_reset(arena *a); // Function to release all allocations of an arena at once
+void arena_free(arena *a); // Function to free the memory of an arena
+void pool_init(block_pool *pool, size_t block_size, int category); // Function to prepare a pool of fixed size blocks
+void *pool_get(block_pool *pool); // Function to take a block from a pool
+void pool_put(block_pool *pool, void *block); // Function to return a block to a pool
+void pool_free(block_pool *pool); // Function to free the memory of a pool
+int open_sink(prime_sink *sink, const char *filename, size_t buffer); // Function to open the output sink
+void close_sink(prime_sink *sink); // Function to finish and close the output sink
+int big_alloc(big_buffer *buf, size_t size, const char *name, int category); // Function to allocate a large buffer
+void big_free(big_buffer *buf); // Function to release a large buffer and report its backing
+size_t huge_page_bytes(const void *ptr); // Function to read how much of a mapping uses huge pages
+void free_base_primes(); // Function to free the sieving primes
+void stats_alloc(int category, size_t bytes); // Function to count an allocation
+void stats_free(int category, size_t bytes); // Function to count a release
+void report_stats(); // Function to print the memory statistics, registered with atexit
+double now_seconds(); // Function to read the monotonic clock
+void timing_add(int phase, const phase_mark *started); // Function to add the time and counters since started to a phase
+phase_mark take_mark(const counter_group *group); // Function to read the clock and the counters of a thread
+void mark_add(phase_mark *total, const phase_mark *from, const phase_mark *to); // Function to add the difference of two marks
+int counters_open(counter_group *group); // Function to open the hardware counters of the calling thread
+void counters_close(counter_group *group); // Function to close the hardware counters
+void report_timing(); // Function to print the phase timings, registered with atexit
+void trace_add(trace_buffer *buffer, int phase, double start, double end, uint64_t first); // Function to record a trace event
+void write_trace(); // Function to write the trace in Chrome trace event format, registered with atexit
+void *progress_thread(void *arg); // Function of the thread reporting the progress of the segmented sieve
+void progress_signal(int signum); // Function to request a progress report on SIGUSR1
+void progress_install(); // Function to install the SIGUSR1 handler for --progress
+unsigned long long count_flat(unsigned limit); // Function to count the primes with the full sieve
+int run_benchmark(unsigned long long top); // Function to benchmark the engines over a range of limits
+int run_microbench(); // Function to benchmark the cross-off kernels on their own
+int run_outbench(unsigned long long n); // Function to benchmark the formatters and writers of the output
+int run_verify(unsigned long long top); // Function to verify the engines up to top
+int run_scaling(unsigned long long n); // Function to measure the speedup over the thread count
+int print_small_primes(unsigned limit, const char *filename); // Function to sieve and write small limits from static memory
+int run_startup(); // Function to measure the time to the first output byte and to exit
+size_t select_cpus(int *cpus, size_t max, int smt); // Function to list the processors for pinned workers
+uint64_t segment_digest(const uint64_t *bits, size_t words); // Function to hash the bitmap of a segment
+size_t format_table(char *text, uint64_t value); // Function to format a number two digits at a time
+size_t format_increment(char *text, uint64_t value, char *digits, size_t *length, uint64_t *previous); // Function to format a number from the previous one
+int writer_open(out_writer *wr, int kind, const char *path); // Function to open the output file of a writer
+int writer_put(out_writer *wr, const char *data, size_t n); // Function to write a block of text
+int writer_close(out_writer *wr, const char *tail, size_t n); // Function to write the last bytes and close
+void bench_summary(const double *samples, int n, double *median, double *low, double *high); // Function to get the median and its confidence interval
+double mann_whitney(const double *base, int nb, const double *cur, int nc); // Function to test whether the current samples are larger
+size_t load_baseline(const char *path, bench_result **results); // Function to read benchmark results from a JSON file
+int compare_baseline(const bench_result *current, size_t count, const char *path); // Function to compare benchmark results with a baseline
 
 //main function
 int main(int argc, char* argv[]){
 
+    program_start = now_seconds();
     // Read command line arguments though the read_cmnd_arg function
     if (read_cmnd_arg(argc, argv) != EXIT_SUCCESS) {
         return EXIT_FAILURE;
     }
-    // Check if the limit is set, if not, ask the user for input
-    if (limit == 0) {
-        printf("Please enter an upper limit for prime number generation (between 2 and %u): ", MAX_LIMIT);
-        char input[20]; // Buffer for user input
+    if (use_counters && counters_open(&main_counters) != EXIT_SUCCESS) {
+        fprintf(stderr, "Hardware counters unavailable (%s), reporting timings only\n", counters_error);
+    }
+    phase_mark parsed = { program_start, { 0 } };
+    timing_add(TIME_PARSE, &parsed); // The counters start after parsing
+    if (show_stats || stats_json != NULL) {
+        atexit(report_stats); // Covers every way the program ends
+    }
+    if (show_timing || use_counters) {
+        atexit(report_timing);
+    }
+    if (trace_file != NULL) {
+        atexit(write_trace);
+    }
+    // The benchmark takes the limit as the largest limit to measure and needs no questions
+    if (bench_mode) {
+        return run_benchmark((limit != 0) ? limit : BENCH_TOP);
+    }
+    if (micro_mode) {
+        return run_microbench();
+    }
+    if (pin_threads) {
+        pin_count = select_cpus(pin_cpus, MAX_THREADS, !skip_smt);
+    }
+    if (startup_mode) {
+        return run_startup();
+    }
+    if (scale_mode) {
+        return run_scaling((limit != 0) ? limit : SCALE_LIMIT);
+    }
+    if (verify_mode) {
+        return run_verify((limit != 0) ? limit : VERIFY_LIMIT);
+    }
+    if (outbench_mode) {
+        return run_outbench((limit != 0) ? limit : OUTBENCH_LIMIT);
+    }
+    // Check if the limit is set, if not, ask the user for input; --nth and --is-prime bring their own number
+    if (limit == 0 && query != QUERY_NTH && query != QUERY_IS_PRIME) {
+        printf("Please enter an upper limit for prime number generation (between 2 and %llu): ", max_limit());
+        char input[30]; // Buffer for user input
         if (fgets(input, sizeof(input), stdin) != NULL) {
-            limit = atoi(input); // Convert input to unsigned int
-            if (limit < 2 || limit > MAX_LIMIT) {
-                fprintf(stderr, "Limit must be between 2 and %u\n", MAX_LIMIT);
+            input[strcspn(input, "\n")] = '\0'; // Remove newline character
+            if (parse_limit(input, &limit) != EXIT_SUCCESS || limit < 2 || limit > max_limit()) {
+                fprintf(stderr, "Limit must be between 2 and %llu\n", max_limit());
                 puts("Program aborted due to invalid limit.");
                 return EXIT_FAILURE;
             }
@@ -79,10 +639,40 @@ int main(int argc, char* argv[]){
         }
     }
 
+    // Checked here, as the limit may come from the prompt
+    if (range_low > 2 && range_low > limit) {
+        fprintf(stderr, "Lower bound %llu of --range is above the limit %llu\n", range_low, limit);
+        return EXIT_FAILURE;
+    }
+
+    // Prefix sums produce a single value, there is no list of primes to write
+    if (sum_function != SUM_NONE) {
+        return run_prefix_sum(limit);
+    }
+
+    // Choose the engine for the query so that the run fits in the memory budget
+    sieve_plan plan = plan_query(limit);
+    if (explain) {
+        explain_plan(&plan, limit);
+        return (plan.engine == ENGINE_NONE) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (plan.engine == ENGINE_NONE) {
+        size_t budget = (memory_budget != 0) ? memory_budget : detect_available_memory();
+        fprintf(stderr, "Memory budget of %zu bytes is too small, at least %zu bytes are needed\n", budget, plan.memory);
+        return EXIT_FAILURE;
+    }
+    if (query == QUERY_BITMAP) {
+        return write_bitmap(&plan, limit);
+    }
+    // Counts, the n-th prime and primality are one line, only written to a file with -f
+    if (query != QUERY_LIST) {
+        return run_query(&plan, limit);
+    }
+
     //Check if filename is provided via command line arguments
     if (file_out == NULL) {
         printf("Enter filename for output file (*.csv) or <enter> for screenprint: ");
-        char f_input[50]; // Buffer for user input filename
+        char f_input[50] = ""; // Buffer for user input filename, empty if stdin is closed
         if (fgets(f_input, sizeof(f_input), stdin) != NULL) {
             // Remove newline character from input
             size_t len = strlen(f_input);
@@ -107,18 +697,97 @@ int main(int argc, char* argv[]){
         fprintf(stderr, "\033[1;31mWarning:\033[0m Output file name should end with .csv. Using %s instead.\n", file_out);
     }
 
-    // Initialize the sieve with the specified limit   
-    initialize_sieve(limit); // Initialize the sieve
-    sieve_of_eratosthenes(limit); // Perform the sieve of Eratosthenes
+    // Small limits need no large buffers, which would cost more than the sieving
+    if (plan.engine == ENGINE_SMALL) {
+        if (file_out == NULL) {
+            printf("Prime numbers up to %llu:\n", limit);
+        }
+        if (print_small_primes((unsigned)limit, file_out) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (file_out != NULL) {
+            printf("Sieve written to %s\n", file_out); // Notify user of the file
+        }
+        printf("Program completed successfully.\n");
+        return EXIT_SUCCESS;
+    }
+
+    // Safe and Sophie Germain primes are found with paired segmented bitmaps, no full sieve needed
+    if (plan.engine == ENGINE_PAIRED) {
+        const char *name = (prime_mode == MODE_SAFE) ? "Safe primes" : "Sophie Germain primes";
+        prime_sink sink;
+        phase_mark started = take_mark(&main_counters);
+        if (open_sink(&sink, file_out, plan.output_buffer) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        timing_add(TIME_INIT, &started);
+        if (file_out == NULL) {
+            printf("%s up to %llu:\n", name, limit);
+        }
+        started = take_mark(&main_counters);
+        int status = sieve_safe_primes((unsigned)limit, prime_mode, &sink); // Sieves and formats, timed as sieving
+        timing_add(TIME_SIEVE, &started);
+        started = take_mark(&main_counters);
+        close_sink(&sink);
+        timing_add(TIME_IO, &started);
+        free_base_primes();
+        if (status != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (file_out != NULL) {
+            printf("%s written to %s\n", name, file_out); // Notify user of the file
+        }
+        printf("Program completed successfully.\n");
+        return EXIT_SUCCESS;
+    }
+
+    // Initialize the sieve with the specified limit, if the allocation fails sieve in segments instead
+    phase_mark started = take_mark(&main_counters);
+    if (plan.engine == ENGINE_FLAT && initialize_sieve((unsigned)limit) != EXIT_SUCCESS) {
+        fprintf(stderr, "Falling back to the segmented sieve.\n");
+        plan = plan_sieve(limit, 0);
+    }
+    timing_add(TIME_INIT, &started);
+    if (plan.engine == ENGINE_SEGMENTED) {
+        prime_sink sink;
+        started = take_mark(&main_counters);
+        if (open_sink(&sink, file_out, plan.output_buffer) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        timing_add(TIME_INIT, &started);
+        if (file_out == NULL && plan.low > 2) {
+            printf("Prime numbers from %llu to %llu:\n", (unsigned long long)plan.low, limit);
+        } else if (file_out == NULL) {
+            printf("Prime numbers up to %llu:\n", limit);
+        }
+        int status = sieve_segmented(limit, &plan, &sink);
+        started = take_mark(&main_counters);
+        close_sink(&sink);
+        timing_add(TIME_IO, &started);
+        free_base_primes();
+        if (status != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (file_out != NULL) {
+            printf("Sieve written to %s\n", file_out); // Notify user of the file
+        }
+        printf("Program completed successfully.\n");
+        return EXIT_SUCCESS;
+    }
+    started = take_mark(&main_counters);
+    sieve_of_eratosthenes((unsigned)limit); // Perform the sieve of Eratosthenes
+    timing_add(TIME_SIEVE, &started);
 
     // If a file name is provided, write the sieve to a CSV file
     if (file_out != NULL) {
-        write_sieve_to_csv(file_out, limit); // Write the sieve to a CSV file
+        write_sieve_to_csv(file_out, (unsigned)limit); // Write the sieve to a CSV file
         printf("Sieve written to %s\n", file_out); // Notify user of the file
     } else {
         // If no file name is provided, print the prime numbers to stdout
-        printf("Prime numbers up to %u:\n", limit);
-        print_primes(limit); // Print the prime numbers to stdout
+        printf("Prime numbers up to %llu:\n", limit);
+        started = take_mark(&main_counters);
+        print_primes((unsigned)limit); // Print the prime numbers to stdout
+        timing_add(TIME_FORMAT, &started);
     }
 
     // ** FREEING MEMORY **
@@ -144,6 +813,167 @@ int read_cmnd_arg(int argc, char* argv[]) {
     
     // Iterate over command-line arguments to detect parameters
     for (int i = 1; i < argc; i++){
+        // Long options (--name) are switches, some take the next argument as value
+        if (strncmp(argv[i], "--", 2) == 0) {
+            if (strcmp(argv[i], "--hugepages") == 0) {
+                use_hugetlb = 1;
+            } else if (strcmp(argv[i], "--stream") == 0) {
+                stream_output = 1;
+            } else if (strcmp(argv[i], "--stats") == 0) {
+                show_stats = 1;
+            } else if (strcmp(argv[i], "--stats-json") == 0) {
+                if (i + 1 >= argc || argv[i + 1][0] == '-') {
+                    fprintf(stderr, "Missing file name for parameter %s. Parameter ignored.\n", argv[i]);
+                    continue;
+                }
+                stats_json = argv[++i];
+            } else if (strcmp(argv[i], "--progress") == 0) {
+                char *end = NULL;
+                double value = (i + 1 < argc) ? strtod(argv[i + 1], &end) : 0;
+                if (end == NULL || end == argv[i + 1] || *end != '\0' || value < 0) {
+                    fprintf(stderr, "Progress interval must be 0 or more seconds. Parameter ignored.\n");
+                    continue;
+                }
+                progress_interval = value;
+                progress_install(); // Right away, so that SIGUSR1 never ends the run
+                i++; // Skip the interval
+            } else if (strcmp(argv[i], "--trace") == 0) {
+                if (i + 1 >= argc || argv[i + 1][0] == '-') {
+                    fprintf(stderr, "Missing file name for parameter %s. Parameter ignored.\n", argv[i]);
+                    continue;
+                }
+                trace_file = argv[++i];
+            } else if (strcmp(argv[i], "--timing") == 0) {
+                show_timing = 1;
+            } else if (strcmp(argv[i], "--counters") == 0) {
+                use_counters = 1;
+            } else if (strcmp(argv[i], "--startup") == 0) {
+                startup_mode = 1;
+            } else if (strcmp(argv[i], "--no-fast-path") == 0) {
+                fast_path = 0;
+            } else if (strcmp(argv[i], "--scale") == 0) {
+                scale_mode = 1;
+            } else if (strcmp(argv[i], "--pin") == 0) {
+                pin_threads = 1;
+            } else if (strcmp(argv[i], "--no-smt") == 0) {
+                pin_threads = 1; // Leaving out hardware threads needs pinning
+                skip_smt = 1;
+            } else if (strcmp(argv[i], "--verify") == 0) {
+                verify_mode = 1;
+            } else if (strcmp(argv[i], "--outbench") == 0) {
+                outbench_mode = 1;
+            } else if (strcmp(argv[i], "--microbench") == 0) {
+                micro_mode = 1;
+            } else if (strcmp(argv[i], "--bench") == 0) {
+                bench_mode = 1;
+            } else if (strcmp(argv[i], "--reps") == 0) {
+                int reps = (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) ? atoi(argv[i + 1]) : 0;
+                if (reps < 1 || reps > MAX_BENCH_REPS) {
+                    fprintf(stderr, "Repetitions must be between 1 and %d. Parameter ignored.\n", MAX_BENCH_REPS);
+                    continue;
+                }
+                bench_reps = reps;
+                i++; // Skip the count
+            } else if (strcmp(argv[i], "--baseline") == 0) {
+                if (i + 1 >= argc || argv[i + 1][0] == '-') {
+                    fprintf(stderr, "Missing file name for parameter %s. Parameter ignored.\n", argv[i]);
+                    continue;
+                }
+                baseline_json = argv[++i];
+            } else if (strcmp(argv[i], "--threshold") == 0) {
+                char *end = NULL;
+                double value = (i + 1 < argc) ? strtod(argv[i + 1], &end) : 0;
+                if (end == NULL || end == argv[i + 1] || *end != '\0' || value < 0) {
+                    fprintf(stderr, "Threshold must be a percentage of 0 or more. Parameter ignored.\n");
+                    continue;
+                }
+                regress_threshold = value;
+                i++; // Skip the percentage
+            } else if (strcmp(argv[i], "--bench-json") == 0) {
+                if (i + 1 >= argc || argv[i + 1][0] == '-') {
+                    fprintf(stderr, "Missing file name for parameter %s. Parameter ignored.\n", argv[i]);
+                    continue;
+                }
+                bench_json = argv[++i];
+            } else if (strcmp(argv[i], "--verbose") == 0) {
+                verbose = 1;
+            } else if (strcmp(argv[i], "--count") == 0) {
+                query = QUERY_COUNT;
+            } else if (strcmp(argv[i], "--bitmap") == 0) {
+                if (i + 1 >= argc || argv[i + 1][0] == '-') {
+                    fprintf(stderr, "Missing file name for parameter %s. Parameter ignored.\n", argv[i]);
+                    continue;
+                }
+                bitmap_file = argv[++i];
+                query = QUERY_BITMAP;
+            } else if (strcmp(argv[i], "--explain") == 0) {
+                explain = 1;
+            } else if (strcmp(argv[i], "--range") == 0) {
+                if (i + 1 >= argc || parse_limit(argv[i + 1], &range_low) != EXIT_SUCCESS) {
+                    fprintf(stderr, "Missing or invalid lower bound for parameter %s. Parameter ignored.\n", argv[i]);
+                    range_low = 0;
+                    continue;
+                }
+                i++; // Skip the lower bound
+            } else if (strcmp(argv[i], "--nth") == 0 || strcmp(argv[i], "--is-prime") == 0) {
+                int nth = (strcmp(argv[i], "--nth") == 0);
+                unsigned long long top = nth ? MAX_NTH_INDEX : UINT64_MAX;
+                if (i + 1 >= argc || parse_limit(argv[i + 1], &query_number) != EXIT_SUCCESS || query_number < 1 || query_number > top) {
+                    fprintf(stderr, "%s needs a number between 1 and %llu. Parameter ignored.\n", argv[i], top);
+                    continue;
+                }
+                query = nth ? QUERY_NTH : QUERY_IS_PRIME;
+                i++; // Skip the number
+            } else if (strcmp(argv[i], "--safe") == 0) {
+                prime_mode = MODE_SAFE;
+            } else if (strcmp(argv[i], "--germain") == 0) {
+                prime_mode = MODE_GERMAIN;
+            } else if (strcmp(argv[i], "--memory") == 0) {
+                // Same as -m
+                if (i + 1 >= argc || parse_size(argv[i + 1], &memory_budget) != EXIT_SUCCESS) {
+                    fprintf(stderr, "Missing or invalid value for parameter %s. Parameter ignored.\n", argv[i]);
+                    continue;
+                }
+                i++; // Skip the size
+            } else if (strcmp(argv[i], "--prefetch") == 0) {
+                int distance = (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) ? atoi(argv[i + 1]) : -1;
+                if (distance < 0 || distance > MAX_PREFETCH) {
+                    fprintf(stderr, "Prefetch distance must be between 0 and %d. Parameter ignored.\n", MAX_PREFETCH);
+                    continue;
+                }
+                prefetch_distance = distance;
+                i++; // Skip the distance
+            } else if (strcmp(argv[i], "--segment") == 0) {
+                if (i + 1 >= argc || parse_size(argv[i + 1], &segment_size) != EXIT_SUCCESS || segment_size < MIN_BUFFER || segment_size > MAX_SEGMENT) {
+                    fprintf(stderr, "Segment size must be between %d and %u bytes. Parameter ignored.\n", MIN_BUFFER, MAX_SEGMENT);
+                    segment_size = 0;
+                    continue;
+                }
+                while (segment_size & (segment_size - 1)) {
+                    segment_size &= segment_size - 1; // Round down to a power of two
+                }
+                i++; // Skip the size
+            } else if (strcmp(argv[i], "--sum") == 0) {
+                // Long option with a value: the multiplicative function to sum
+                const char *fn = (i + 1 < argc) ? argv[i + 1] : "";
+                if (strcmp(fn, "mu") == 0 || strcmp(fn, "mertens") == 0) {
+                    sum_function = SUM_MU;
+                } else if (strcmp(fn, "phi") == 0 || strcmp(fn, "totient") == 0) {
+                    sum_function = SUM_PHI;
+                } else if (strcmp(fn, "d") == 0) {
+                    sum_function = SUM_DIVISORS;
+                } else if (strcmp(fn, "sigma") == 0) {
+                    sum_function = SUM_SIGMA;
+                } else {
+                    fprintf(stderr, "Missing or unknown function for parameter %s. Parameter ignored.\n", argv[i]);
+                    continue;
+                }
+                i++; // Skip the function name
+            } else {
+                fprintf(stderr, "Undefined parameter %s ignored.\n", argv[i]);
+            }
+            continue;
+        }
         // Ensure the argument starts with '-' and has length 2
         if (argv[i][0] == '-' && strlen(argv[i]) == 2) { // argv[i][0] is the first character of ith argument
             char operation = tolower((unsigned char)argv[i][1]); //requires ctype.h for tolower()
@@ -172,14 +1002,38 @@ int read_cmnd_arg(int argc, char* argv[]) {
                             i--; // If the next argument is also a flag, decrement i to avoid skipping it
                             break; // Break out of the switch case if no value is provided
                         }
-                        limit = atoi(value); // Convert string to unsigned int
-                        if (limit < 2 || limit > MAX_LIMIT) {
-                            fprintf(stderr, "Limit must be between 2 and %u\n", MAX_LIMIT);
+                        if (parse_limit(value, &limit) != EXIT_SUCCESS || limit < 2 || limit > MAX_STREAM_LIMIT) {
+                            fprintf(stderr, "Limit must be between 2 and %llu\n", max_limit());
                             puts("Program aborted due to invalid limit.");
                             exit(EXIT_FAILURE);
                         }
                         break;
 
+                    case 't':
+                        if (argv[i+1][0] == '-') {
+                            fprintf(stderr, "Missing value for parameter %s. Parameter ignored.\n", argv[i]);
+                            i--; // If the next argument is also a flag, decrement i to avoid skipping it
+                            break; // Break out of the switch case if no value is provided
+                        }
+                        thread_count = atoi(value);
+                        if (thread_count < 1 || thread_count > MAX_THREADS) {
+                            fprintf(stderr, "Number of threads must be between 1 and %d. Parameter ignored.\n", MAX_THREADS);
+                            thread_count = 0;
+                        }
+                        break;
+
+                    case 'm':
+                        if (argv[i+1][0] == '-') {
+                            fprintf(stderr, "Missing value for parameter %s. Parameter ignored.\n", argv[i]);
+                            i--; // If the next argument is also a flag, decrement i to avoid skipping it
+                            break; // Break out of the switch case if no value is provided
+                        }
+                        if (parse_size(value, &memory_budget) != EXIT_SUCCESS) {
+                            fprintf(stderr, "Invalid memory size %s. Parameter ignored.\n", value);
+                            memory_budget = 0;
+                        }
+                        break;
+
                     default:
                         fprintf(stderr, "Undefined parameter -%c ignored.\n", operation);
                         if (argv[i+1][0] == '-') {
@@ -209,6 +1063,20 @@ int read_cmnd_arg(int argc, char* argv[]) {
             continue; // Continue to the next iteration of the loop
         }
     }
+    if ((range_low > 2 || query == QUERY_COUNT || query == QUERY_BITMAP) && prime_mode != MODE_PRIMES) {
+        fprintf(stderr, "--range, --count and --bitmap work on all primes, not with --safe or --germain\n");
+        exit(EXIT_FAILURE);
+    }
+    if (range_low > 2 && verify_mode) {
+        fprintf(stderr, "--verify checks the whole range from 2 with its own counts, it does not take --range\n");
+        exit(EXIT_FAILURE);
+    }
+    // The allowed range depends on the mode, which can be given after -n
+    if (limit > max_limit()) {
+        fprintf(stderr, "Limit must be between 2 and %llu\n", max_limit());
+        puts("Program aborted due to invalid limit.");
+        exit(EXIT_FAILURE);
+    }
     return EXIT_SUCCESS;
 }
 
@@ -217,29 +1085,76 @@ void print_help() {
     printf("Usage: ./eratos3 -f [output_filename] -n [integer value]\n");
     printf("Options:\n");
     printf("  -f [output_filename] : Specify the output file name for the sieve. When omitted standard output (terminal).\n");
-    printf("  -n [integer value]   : Specify the limit for prime number generation (must be between 2 and %u)\n", MAX_LIMIT);
+    printf("  -n [integer value]   : Specify the limit for prime number generation (must be between 2 and %llu,\n", MAX_STREAM_LIMIT);
+    printf("                         safe and Sophie Germain primes up to %u). Accepts powers of ten such as 1e12\n", MAX_LIMIT);
+    printf("  --stream             : Stream the primes block by block with memory independent of the limit,\n");
+    printf("                         also when the full sieve would fit. Always used above %u\n", MAX_LIMIT);
+    printf("  --segment [size]     : Segment size of the segmented sieve such as 256K, default 32K, at most 256M\n");
+    printf("  --prefetch [entries] : Prefetch distance in the large prime loop, 0 disables (default %d)\n", PREFETCH_DISTANCE);
+    printf("  -t [threads]         : Number of worker threads of the segmented sieve, default one per processor within the cgroup quota\n");
+    printf("  -m, --memory [size]  : Memory budget such as 512M or 2G, default is the available memory.\n");
+    printf("                         The full sieve is replaced by a segmented sieve when it does not fit\n");
+    printf("  --hugepages          : Back large buffers by hugetlbfs pages (2 MiB or 1 GiB) when reserved\n");
+    printf("  --stats              : Report peak memory, bytes allocated per phase and page faults at exit\n");
+    printf("  --stats-json [file]  : Write the same statistics as JSON to file\n");
+    printf("  --progress [seconds] : Report progress, rate and ETA of the segmented sieve every few seconds,\n");
+    printf("                         and on SIGUSR1; 0 reports on SIGUSR1 only\n");
+    printf("  --trace [file]       : Write a timeline of every segment and write in Chrome trace format to file\n");
+    printf("  --timing             : Report the time of every phase and worker thread at exit\n");
+    printf("  --counters           : Like --timing, plus cycles, instructions, cache, branch and TLB misses\n");
+    printf("                         per phase and kernel from the hardware performance counters\n");
+    printf("  --startup            : Measure the time from process start to the first output byte and to exit\n");
+    printf("                         for small limits, started in several ways\n");
+    printf("  --no-fast-path       : Sieve limits up to %d like larger ones, without the static fast path\n", FAST_PATH_LIMIT);
+    printf("  --scale              : Measure speedup, efficiency and memory traffic of the segmented sieve\n");
+    printf("                         on 1, 2, 4, ... threads up to -n (default 1e9)\n");
+    printf("  --pin                : Pin every worker thread to a processor of its own\n");
+    printf("  --no-smt             : Pin to one hardware thread per core only, implies --pin\n");
+    printf("  --verify             : Check prime counts against known values of pi(x) and the segments of the\n");
+    printf("                         engines against each other, up to -n (default 1e9)\n");
+    printf("  --bench              : Benchmark all engines for limits 1e6, 1e7, ... up to -n (default 1e9),\n");
+    printf("                         with -f [file] the results are also written as CSV\n");
+    printf("  --microbench         : Time the small, medium and large prime kernels on their own in ns per\n");
+    printf("                         cross-off for segments of 8K to 1M, with -f [file] also written as CSV\n");
+    printf("  --outbench           : Time every formatter and writer of the output on the primes up to -n\n");
+    printf("                         (default 1e8) in MB/s and primes/s, with -f [file] also written as CSV\n");
+    printf("  --reps [count]       : Repetitions per benchmark case, default %d\n", BENCH_REPS);
+    printf("  --bench-json [file]  : Write the benchmark results, including all samples, as JSON to file\n");
+    printf("  --baseline [file]    : Compare the benchmark with results saved by --bench-json, fail on a regression\n");
+    printf("  --threshold [pct]    : Slowdown in percent that counts as a regression, default %.0f\n", REGRESS_THRESHOLD);
+    printf("  --verbose            : Report details such as the memory backing of large buffers\n");
+    printf("  --count              : Count the primes up to the limit instead of listing them\n");
+    printf("  --range [low]        : List or count only the primes from low up to the limit\n");
+    printf("  --nth [n]            : Find the n-th prime, n up to %llu\n", MAX_NTH_INDEX);
+    printf("  --is-prime [number]  : Test whether a number below 2^64 is prime\n");
+    printf("  --bitmap [file]      : Write the bitmap of the odd numbers up to the limit (from --range) to file,\n");
+    printf("                         segment by segment, for bitmaps larger than the memory\n");
+    printf("  --explain            : Print the plan for the query (engine, threads, memory, output) and stop\n");
+    printf("  --safe               : List safe primes p, where (p-1)/2 is also prime\n");
+    printf("  --germain            : List Sophie Germain primes q, where 2q+1 is also prime\n");
+    printf("  --sum [mu|phi|d|sigma] : Compute the sum of f(n) for n up to the limit (at most %llu),\n", MAX_SUM_LIMIT);
+    printf("                         mu gives the Mertens function, phi the summatory totient\n");
     printf("  -h, --help           : Display this help message\n");
     printf("Example: ./eratos3 -f output.csv -n 100\n");
     printf("This will generate a sieve of Eratosthenes up to 100 and save it to output.csv\n");
 }
 
-// FUNCTION: initialize sieve with the given limit
-void initialize_sieve(unsigned limit) {
-    sieve = malloc((limit + 1) * sizeof(size_t));
-    if (sieve == NULL) {
+// FUNCTION: initialize sieve with the given limit, returns EXIT_FAILURE if the memory is not available
+int initialize_sieve(unsigned limit) {
+    if (big_alloc(&sieve_buffer, ((size_t)limit + 1) * sizeof(*sieve), "sieve", STAT_SIEVE) != EXIT_SUCCESS) {
         fprintf(stderr, "Memory allocation failed\n");
-        exit(EXIT_FAILURE);
-    }
-    for (int i = 0; i <= limit; i++) {
-        sieve[i] = IS_PRIME; // Assume all numbers are prime initially
+        return EXIT_FAILURE;
     }
+    sieve = sieve_buffer.ptr; // Zero filled by big_alloc, so all numbers start as IS_PRIME
     sieve[0] = NOT_PRIME; // 0 is not prime
     sieve[1] = NOT_PRIME; // 1 is not prime
+    return EXIT_SUCCESS;
 }
 
 // FUNCTION: implement the Sieve of Eratosthenes algorithm
 void sieve_of_eratosthenes(unsigned limit) {
-    for (unsigned i = 2; i <= sqrt(limit); i++) {
+    unsigned root = (unsigned)isqrt_u64(limit); // Once, instead of a libm call per iteration
+    for (unsigned i = 2; i <= root; i++) {
         if (sieve[i] == IS_PRIME) {
             for (unsigned j = i * i; j <= limit; j += i) {
                 sieve[j] = NOT_PRIME; // Mark multiples of i as not prime
@@ -271,6 +1186,7 @@ void write_sieve_to_csv(const char *filename, unsigned limit) {
         return;
     }
     int first = 1;
+    phase_mark started = take_mark(&main_counters);
     for (unsigned i = 2; i <= limit; i++) {
         if (sieve[i] == IS_PRIME) {
             if (!first) {
@@ -281,10 +1197,3742 @@ void write_sieve_to_csv(const char *filename, unsigned limit) {
         }
     }
     fprintf(fp, "\n");
+    timing_add(TIME_FORMAT, &started); // Includes the writes of full stdio buffers
+    started = take_mark(&main_counters);
     fclose(fp);
+    timing_add(TIME_IO, &started);
+}
+
+// FUNCTION: upper bound of pi(x), 1.25506 x / ln x by Rosser and Schoenfeld, for sizing prime lists
+uint64_t prime_count_bound(uint64_t x) {
+    if (x < 2) {
+        return 0;
+    }
+    return (uint64_t)(1.25506 * (double)x / log((double)x)) + 1;
 }
 
 // FUNCTION: to free the allocated memory for the sieve
 void free_sieve() {
-    free(sieve); // Free the allocated memory for the sieve
-}
\ No newline at end of file
+    big_free(&sieve_buffer); // Free the allocated memory for the sieve
+}
+// FUNCTION: integer square root, exact for all 64-bit values
+uint64_t isqrt_u64(uint64_t n) {
+    uint64_t r = (uint64_t)sqrt((double)n);
+    if (r > UINT32_MAX) {
+        r = UINT32_MAX; // The estimate rounds up to 2^32 near UINT64_MAX, whose square overflows
+    }
+    while (r > 0 && r * r > n) {
+        r--; // Correct rounding up of the floating point estimate
+    }
+    while (r < UINT32_MAX && (r + 1) * (r + 1) <= n) {
+        r++; // Correct rounding down of the floating point estimate
+    }
+    return r;
+}
+
+/* FUNCTION: generate the sieving primes
+ * Collects all primes up to and including bound in base_primes with a small byte sieve.
+ * These are the only primes needed to sieve any segment up to bound^2.
+ */
+int generate_base_primes(uint64_t bound) {
+    phase_mark started = take_mark(&main_counters);
+    unsigned char *small = calloc(bound + 1, 1); // All IS_PRIME
+    if (small == NULL) {
+        fprintf(stderr, "Memory allocation failed for base primes\n");
+        return EXIT_FAILURE;
+    }
+    stats_alloc(STAT_BASE, bound + 1);
+    size_t count = 0;
+    for (uint64_t i = 2; i <= bound; i++) {
+        if (small[i] == IS_PRIME) {
+            count++;
+            for (uint64_t j = i * i; j <= bound; j += i) {
+                small[j] = NOT_PRIME; // Mark multiples of i as not prime
+            }
+        }
+    }
+    free_base_primes();
+    base_primes = malloc((count + 1) * sizeof(*base_primes));
+    if (base_primes == NULL) {
+        fprintf(stderr, "Memory allocation failed for base primes\n");
+        free(small);
+        stats_free(STAT_BASE, bound + 1);
+        return EXIT_FAILURE;
+    }
+    stats_alloc(STAT_BASE, (count + 1) * sizeof(*base_primes));
+    base_count = 0;
+    for (uint64_t i = 2; i <= bound; i++) {
+        if (small[i] == IS_PRIME) {
+            base_primes[base_count++] = (uint32_t)i;
+        }
+    }
+    free(small);
+    stats_free(STAT_BASE, bound + 1);
+    timing_add(TIME_BASE, &started);
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: free the sieving primes
+void free_base_primes() {
+    if (base_primes != NULL) {
+        free(base_primes);
+        stats_free(STAT_BASE, (base_count + 1) * sizeof(*base_primes));
+        base_primes = NULL;
+        base_count = 0;
+    }
+}
+
+/* FUNCTION: sieve a segment of odd numbers
+ * Bit i of bits represents the odd number 2 * (first + i) + 1. On return a clear bit means prime,
+ * set bits are crossed out, like the entries of the full sieve. Bits past nbits are set.
+ * The base primes must cover the square root of the largest number in the segment.
+ */
+void sieve_odd_segment(uint64_t *bits, uint64_t first, size_t nbits) {
+    size_t words = (nbits + 63) / 64;
+    memset(bits, 0, words * sizeof(uint64_t));
+    if (nbits % 64 != 0) {
+        bits[words - 1] = ~((UINT64_C(1) << (nbits % 64)) - 1); // Cross out bits past the end of the segment
+    }
+    if (first == 0) {
+        bits[0] |= UINT64_C(1); // 1 is not prime
+    }
+    uint64_t low = 2 * first + 1; // Smallest number in the segment
+    uint64_t high = 2 * (first + nbits - 1) + 1; // Largest number in the segment
+    for (size_t k = 1; k < base_count; k++) { // Skip 2, there are no even numbers in the segment
+        uint64_t p = base_primes[k];
+        if (p * p > high) {
+            break;
+        }
+        uint64_t m = (low + p - 1) / p * p; // First multiple of p in the segment
+        if (m < p * p) {
+            m = p * p; // Smaller multiples are already crossed out by smaller primes
+        }
+        if (m % 2 == 0) {
+            m += p; // Only odd multiples are stored
+        }
+        for (uint64_t j = (m - 1) / 2 - first; j < nbits; j += p) {
+            bits[j / 64] |= UINT64_C(1) << (j % 64); // Mark multiple as not prime
+        }
+    }
+}
+
+/* FUNCTION: sieve a segment of all numbers
+ * Bit i of bits represents the number first + i. On return a clear bit means prime.
+ */
+void sieve_all_segment(uint64_t *bits, uint64_t first, size_t nbits) {
+    size_t words = (nbits + 63) / 64;
+    memset(bits, 0, words * sizeof(uint64_t));
+    if (nbits % 64 != 0) {
+        bits[words - 1] = ~((UINT64_C(1) << (nbits % 64)) - 1); // Cross out bits past the end of the segment
+    }
+    for (uint64_t n = first; n < 2 && n < first + nbits; n++) {
+        bits[0] |= UINT64_C(1) << (n - first); // 0 and 1 are not prime
+    }
+    uint64_t high = first + nbits - 1; // Largest number in the segment
+    for (size_t k = 0; k < base_count; k++) {
+        uint64_t p = base_primes[k];
+        if (p * p > high) {
+            break;
+        }
+        uint64_t m = (first + p - 1) / p * p; // First multiple of p in the segment
+        if (m < p * p) {
+            m = p * p; // Smaller multiples are already crossed out by smaller primes
+        }
+        for (uint64_t j = m - first; j < nbits; j += p) {
+            bits[j / 64] |= UINT64_C(1) << (j % 64); // Mark multiple as not prime
+        }
+    }
+}
+
+/* FUNCTION: find safe primes or Sophie Germain primes
+ * A safe prime p = 2q + 1 has a Sophie Germain prime q. Bit i of the odd bitmap stands for 2i + 1
+ * and bit i of the plain bitmap stands for i, so the segments of both ranges line up bit for bit.
+ * ORing the two bitmaps word by word leaves clear bits exactly for the pairs where both numbers are prime.
+ * In MODE_SAFE the numbers p up to limit are written, in MODE_GERMAIN the numbers q up to limit.
+ * Returns EXIT_FAILURE if the memory is not available.
+ */
+int sieve_safe_primes(unsigned limit, int mode, prime_sink *sink) {
+    uint64_t last = (mode == MODE_SAFE) ? ((uint64_t)limit - 1) / 2 : limit; // Largest index i
+    if (generate_base_primes(isqrt_u64(2 * last + 1)) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    uint64_t *p_bits = malloc(SEGMENT_BITS / 8);
+    uint64_t *q_bits = malloc(SEGMENT_BITS / 8);
+    if (p_bits == NULL || q_bits == NULL) {
+        fprintf(stderr, "Memory allocation failed for segment\n");
+        free(p_bits);
+        free(q_bits);
+        return EXIT_FAILURE;
+    }
+    stats_alloc(STAT_SEGMENTS, 2 * (SEGMENT_BITS / 8));
+    for (uint64_t first = 0; first <= last; first += SEGMENT_BITS) {
+        size_t nbits = (last - first + 1 < SEGMENT_BITS) ? (size_t)(last - first + 1) : SEGMENT_BITS;
+        sieve_odd_segment(p_bits, first, nbits); // Candidates for p = 2i + 1
+        sieve_all_segment(q_bits, first, nbits); // Candidates for q = i
+        for (size_t w = 0; w < (nbits + 63) / 64; w++) {
+            uint64_t hits = ~(p_bits[w] | q_bits[w]);
+            while (hits != 0) {
+                uint64_t i = first + w * 64 + (uint64_t)__builtin_ctzll(hits);
+                sink_put(sink, (mode == MODE_SAFE) ? 2 * i + 1 : i);
+                hits &= hits - 1; // Clear the lowest set bit
+            }
+        }
+    }
+    free(p_bits);
+    free(q_bits);
+    stats_free(STAT_SEGMENTS, 2 * (SEGMENT_BITS / 8));
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: write a number to the output sink
+void sink_put(prime_sink *sink, uint64_t value) {
+    if (sink->fp == NULL) {
+        sink->count++; // Counting sink
+        return;
+    }
+    if (!sink->first) {
+        fputc(sink->sep, sink->fp);
+    }
+    fprintf(sink->fp, "%llu", (unsigned long long)value);
+    sink->first = 0;
+    sink->count++;
+}
+
+// FUNCTION: parse an unsigned integer, plain digits or with a power of ten such as 1e12
+int parse_limit(const char *text, unsigned long long *value) {
+    if (!isdigit((unsigned char)text[0])) {
+        return EXIT_FAILURE;
+    }
+    errno = 0;
+    char *end;
+    unsigned long long result = strtoull(text, &end, 10);
+    if (errno == ERANGE) {
+        return EXIT_FAILURE;
+    }
+    if (*end == 'e' || *end == 'E') {
+        char *exp_end;
+        unsigned long exponent = strtoul(end + 1, &exp_end, 10);
+        if (exp_end == end + 1 || exponent > 19) {
+            return EXIT_FAILURE;
+        }
+        for (unsigned long k = 0; k < exponent; k++) {
+            if (result > ULLONG_MAX / 10) {
+                return EXIT_FAILURE; // Overflow
+            }
+            result *= 10;
+        }
+        end = exp_end;
+    }
+    if (*end != '\0') {
+        return EXIT_FAILURE; // Trailing characters
+    }
+    *value = result;
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: maximum limit for the selected mode
+unsigned long long max_limit() {
+    if (sum_function != SUM_NONE) {
+        return MAX_SUM_LIMIT;
+    }
+    return (prime_mode == MODE_PRIMES) ? MAX_STREAM_LIMIT : MAX_LIMIT;
+}
+
+// FUNCTION: format a signed 128-bit integer, buf must hold at least 41 characters
+char *format_wide(wide_t value, char *buf) {
+    char digits[41];
+    int n = 0;
+    unsigned __int128 u = (value < 0) ? -(unsigned __int128)value : (unsigned __int128)value;
+    do {
+        digits[n++] = (char)('0' + (int)(u % 10));
+        u /= 10;
+    } while (u != 0);
+    int k = 0;
+    if (value < 0) {
+        buf[k++] = '-';
+    }
+    while (n > 0) {
+        buf[k++] = digits[--n];
+    }
+    buf[k] = '\0';
+    return buf;
+}
+
+/* FUNCTION: compute and report a prefix sum
+ * The sum is computed with the min_25 sieve, --verify checks it against the linear sieve.
+ * With -f the result is also written to the file as limit,sum.
+ */
+int run_prefix_sum(unsigned long long x) {
+    static const char *names[] = { "", "mu(n) (Mertens function)", "phi(n) (summatory totient)", "d(n)", "sigma(n)" };
+    char buf[41];
+    wide_t sum = 0;
+    int status = prefix_sum_min25(sum_function, x, &sum);
+    free_base_primes();
+    if (status != EXIT_SUCCESS) {
+        fprintf(stderr, "Prefix sum up to %llu could not be computed\n", x);
+        return EXIT_FAILURE;
+    }
+    printf("Sum of %s for n up to %llu: %s\n", names[sum_function], x, format_wide(sum, buf));
+    if (file_out != NULL) {
+        FILE *fp = fopen(file_out, "w");
+        if (!fp) {
+            fprintf(stderr, "Failed to open file %s for writing\n", file_out);
+            return EXIT_FAILURE;
+        }
+        fprintf(fp, "%llu,%s\n", x, buf);
+        fclose(fp);
+        printf("Sum written to %s\n", file_out);
+    }
+    printf("Program completed successfully.\n");
+    return EXIT_SUCCESS;
+}
+
+/* FUNCTION: value of the multiplicative function f at a prime power
+ * pe is p^e. Every supported f has f(p) = a0 + a1 * p, the form needed by the min_25 sieve.
+ */
+wide_t prime_power_value(int fn, uint64_t p, uint64_t pe, int e) {
+    switch (fn) {
+        case SUM_MU:
+            return (e == 1) ? -1 : 0;
+        case SUM_PHI:
+            return (wide_t)(pe - pe / p);
+        case SUM_DIVISORS:
+            return e + 1;
+        default: // SUM_SIGMA: 1 + p + ... + p^e
+            return ((wide_t)pe * p - 1) / (p - 1);
+    }
+}
+
+/* FUNCTION: prefix sum with the min_25 sieve
+ * Part one counts and sums the primes up to every value x / i (Lucy's dynamic programme), which gives
+ * the sum of f over primes. Part two adds the composites by recursing over their smallest prime factor.
+ * Both parts take about x^(3/4) / log(x) steps and O(sqrt(x)) memory, so limits beyond 1e12 are feasible.
+ * Returns EXIT_FAILURE if the memory is not available.
+ */
+static uint64_t m25_x;       // Limit of the current min_25 computation
+static uint64_t m25_root;    // Integer square root of m25_x
+static int m25_fn;           // Function being summed
+static size_t *m25_small;    // Index of value v in the tables for v <= root
+static size_t *m25_large;    // Index of value v in the tables for v > root, by x / v
+static wide_t *m25_prime_f;  // Sum of f(p) over primes p <= v, per table index
+static wide_t *m25_prefix;   // Sum of f(p) over the first j base primes
+
+static size_t m25_index(uint64_t v) {
+    return (v <= m25_root) ? m25_small[v] : m25_large[m25_x / v];
+}
+
+// Sum of f(m) for 2 <= m <= n where the smallest prime factor of m is at least base_primes[j]
+static wide_t m25_composites(uint64_t n, size_t j) {
+    if (j < base_count && base_primes[j] > n) {
+        return 0;
+    }
+    wide_t result = m25_prime_f[m25_index(n)] - m25_prefix[j];
+    for (size_t k = j; k < base_count && (uint64_t)base_primes[k] * base_primes[k] <= n; k++) {
+        uint64_t p = base_primes[k];
+        uint64_t pe = p;
+        for (int e = 1; pe * p <= n; e++, pe *= p) {
+            result += prime_power_value(m25_fn, p, pe, e) * m25_composites(n / pe, k + 1)
+                    + prime_power_value(m25_fn, p, pe * p, e + 1);
+        }
+    }
+    return result;
+}
+
+int prefix_sum_min25(int fn, uint64_t x, wide_t *sum) {
+    // f(p) = a0 + a1 * p for every supported function
+    static const int a0[] = { 0, -1, -1, 2, 1 };
+    static const int a1[] = { 0, 0, 1, 0, 1 };
+    m25_x = x;
+    m25_fn = fn;
+    m25_root = isqrt_u64(x);
+    if (generate_base_primes(m25_root) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    size_t cap = 2 * m25_root + 3;
+    uint64_t *values = malloc(cap * sizeof(*values));
+    int64_t *count = malloc(cap * sizeof(*count)); // Number of primes up to values[i]
+    wide_t *total = malloc(cap * sizeof(*total));  // Sum of primes up to values[i]
+    m25_small = malloc((m25_root + 2) * sizeof(*m25_small));
+    m25_large = malloc((m25_root + 2) * sizeof(*m25_large));
+    m25_prime_f = malloc(cap * sizeof(*m25_prime_f));
+    m25_prefix = malloc((base_count + 1) * sizeof(*m25_prefix));
+    if (!values || !count || !total || !m25_small || !m25_large || !m25_prime_f || !m25_prefix) {
+        fprintf(stderr, "Memory allocation failed for prefix sum tables\n");
+        free(values);
+        free(count);
+        free(total);
+        free(m25_small);
+        free(m25_large);
+        free(m25_prime_f);
+        free(m25_prefix);
+        return EXIT_FAILURE;
+    }
+    size_t table_bytes = cap * (sizeof(*values) + sizeof(*count) + sizeof(*total) + sizeof(*m25_prime_f))
+                       + 2 * (m25_root + 2) * sizeof(*m25_small) + (base_count + 1) * sizeof(*m25_prefix);
+    stats_alloc(STAT_SUMS, table_bytes);
+    // All distinct values x / i in decreasing order
+    size_t n = 0;
+    for (uint64_t i = 1; i <= x; i = x / (x / i) + 1) {
+        uint64_t v = x / i;
+        values[n] = v;
+        count[n] = (int64_t)v - 1;
+        unsigned __int128 tri = (unsigned __int128)v * (v + 1) / 2;
+        total[n] = (wide_t)tri - 1;
+        if (v <= m25_root) {
+            m25_small[v] = n;
+        } else {
+            m25_large[x / v] = n;
+        }
+        n++;
+    }
+    // Remove the composites with smallest prime factor p, for each sieving prime in turn
+    for (size_t k = 0; k < base_count; k++) {
+        uint64_t p = base_primes[k];
+        size_t below = m25_index(p - 1);
+        int64_t count_below = count[below];
+        wide_t total_below = total[below];
+        for (size_t i = 0; i < n && values[i] >= p * p; i++) {
+            size_t q = m25_index(values[i] / p);
+            count[i] -= count[q] - count_below;
+            if (a1[fn] != 0) {
+                total[i] -= (wide_t)p * (total[q] - total_below); // Only needed when f(p) depends on p
+            }
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        m25_prime_f[i] = (wide_t)a0[fn] * count[i] + (wide_t)a1[fn] * total[i];
+    }
+    m25_prefix[0] = 0;
+    for (size_t k = 0; k < base_count; k++) {
+        m25_prefix[k + 1] = m25_prefix[k] + prime_power_value(fn, base_primes[k], base_primes[k], 1);
+    }
+    *sum = 1 + m25_composites(x, 0); // f(1) = 1
+    free(values);
+    free(count);
+    free(total);
+    free(m25_small);
+    free(m25_large);
+    free(m25_prime_f);
+    free(m25_prefix);
+    stats_free(STAT_SUMS, table_bytes);
+    return EXIT_SUCCESS;
+}
+
+/* FUNCTION: prefix sum with the linear sieve
+ * Reference implementation: every n up to x is visited once as i * p with p its smallest prime factor,
+ * and f(n) follows from f of the part coprime to p and f of the full power of p in n.
+ * Only used by --verify, as it needs O(x) memory.
+ */
+int prefix_sum_linear(int fn, uint64_t x, wide_t *sum) {
+    uint32_t *primes = malloc((x + 1) * sizeof(*primes));
+    uint64_t *power = malloc((x + 1) * sizeof(*power)); // Largest power of the smallest prime factor
+    int *expo = malloc((x + 1) * sizeof(*expo));         // Exponent of that power
+    wide_t *f = malloc((x + 1) * sizeof(*f));
+    if (!primes || !power || !expo || !f) {
+        fprintf(stderr, "Memory allocation failed for linear sieve\n");
+        free(primes);
+        free(power);
+        free(expo);
+        free(f);
+        return EXIT_FAILURE;
+    }
+    size_t table_bytes = (x + 1) * (sizeof(*primes) + sizeof(*power) + sizeof(*expo) + sizeof(*f));
+    stats_alloc(STAT_SUMS, table_bytes);
+    memset(power, 0, (x + 1) * sizeof(*power));
+    size_t np = 0;
+    f[1] = 1;
+    *sum = 1;
+    for (uint64_t i = 2; i <= x; i++) {
+        if (power[i] == 0) { // Not reached by a smaller number, so i is prime
+            primes[np++] = (uint32_t)i;
+            power[i] = i;
+            expo[i] = 1;
+            f[i] = prime_power_value(fn, i, i, 1);
+        }
+        *sum += f[i];
+        for (size_t k = 0; k < np && primes[k] * i <= x; k++) {
+            uint64_t p = primes[k];
+            uint64_t n = p * i;
+            if (i % p == 0) { // p is the smallest prime factor of i, raise its power
+                power[n] = power[i] * p;
+                expo[n] = expo[i] + 1;
+                uint64_t rest = i / power[i];
+                f[n] = f[rest] * prime_power_value(fn, p, power[n], expo[n]);
+                break;
+            }
+            power[n] = p;
+            expo[n] = 1;
+            f[n] = f[i] * f[p];
+        }
+    }
+    free(primes);
+    free(power);
+    free(expo);
+    free(f);
+    stats_free(STAT_SUMS, table_bytes);
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: parse a size in bytes, with an optional K, M, G or T suffix (powers of 1024)
+int parse_size(const char *text, size_t *value) {
+    if (!isdigit((unsigned char)text[0])) {
+        return EXIT_FAILURE;
+    }
+    errno = 0;
+    char *end;
+    unsigned long long result = strtoull(text, &end, 10);
+    if (errno == ERANGE) {
+        return EXIT_FAILURE;
+    }
+    int shift = 0;
+    switch (toupper((unsigned char)*end)) {
+        case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+        case 'T': shift = 40; end++; break;
+        default: break;
+    }
+    if (shift != 0 && strcmp(end, "iB") == 0) {
+        end += 2; // Accept 512MiB
+    } else if (toupper((unsigned char)*end) == 'B') {
+        end++; // Accept 512MB and 4096B
+    }
+    if (*end != '\0' || result == 0 || result > (SIZE_MAX >> shift)) {
+        return EXIT_FAILURE;
+    }
+    *value = (size_t)(result << shift);
+    return EXIT_SUCCESS;
+}
+
+/* FUNCTION: detect the available memory
+ * Uses MemAvailable from /proc/meminfo, which includes reclaimable caches, and falls back to the
+ * number of free pages. In a container the host's memory is not the limit, so the room left in the
+ * cgroup is taken when it is smaller. Returns SIZE_MAX if nothing is known.
+ */
+size_t detect_available_memory() {
+    size_t available = SIZE_MAX;
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (fp != NULL) {
+        char line[128];
+        unsigned long long kib;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "MemAvailable: %llu kB", &kib) == 1) {
+                available = (size_t)kib * 1024;
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    if (available == SIZE_MAX) {
+        long pages = sysconf(_SC_AVPHYS_PAGES);
+        long page_size = sysconf(_SC_PAGESIZE);
+        if (pages > 0 && page_size > 0) {
+            available = (size_t)pages * (size_t)page_size;
+        }
+    }
+    const resource_limits *res = detect_resources();
+    return (res->memory_left < available) ? res->memory_left : available;
+}
+
+/* FUNCTION: choose how to sieve up to limit within the memory budget
+ * The full sieve array is used when it fits, as it has always been. Otherwise the range is sieved in
+ * blocks of segments by the worker threads, and each block is written out before its memory is reused.
+ * This needs memory for the sieving primes and, per thread, one segment, the sieving state and the text
+ * of two blocks (the pipeline depth), plus the output buffer. Small budgets first cost threads, then block and segment size.
+ * A budget of 0 asks for the smallest segmented plan.
+ */
+sieve_plan plan_sieve(unsigned long long limit, size_t budget) {
+    sieve_plan plan = { ENGINE_NONE, SEGMENT_BITS / 8, 2, OUTPUT_BUFFER, 0, 1, BLOCK_SEGMENTS, (size_t)prefetch_distance, range_low };
+    if (segment_size != 0) {
+        plan.segment_bytes = segment_size;
+    }
+    while (plan.block_segments > 1 && (uint64_t)plan.segment_bytes * 8 * plan.block_segments >= (UINT64_C(1) << 32)) {
+        plan.block_segments /= 2; // Bit offsets in a block must fit in 32 bits, whatever the budget
+    }
+    uint64_t root = isqrt_u64(limit);
+    size_t base = (size_t)(root + 1) + (size_t)(prime_count_bound(root) + 1) * sizeof(*base_primes); // Byte sieve and prime list
+    if (limit <= MAX_LIMIT && budget != 0 && !stream_output && query == QUERY_LIST && range_low <= 2) { // Lists from 2
+        size_t flat = ((size_t)limit + 1) * sizeof(*sieve);
+        if (flat <= budget && plan.output_buffer <= budget - flat) {
+            plan.engine = ENGINE_FLAT;
+            plan.memory = flat + plan.output_buffer;
+            return plan;
+        }
+    }
+    plan.engine = ENGINE_SEGMENTED;
+    plan.threads = (thread_count > 0) ? (size_t)thread_count : detect_cpu_count();
+    plan.memory = base + plan.output_buffer + plan.threads * worker_memory(&plan, limit);
+    if (budget == 0) {
+        plan.threads = 1;
+        plan.block_segments = 1;
+        plan.segment_bytes = MIN_BUFFER;
+        plan.output_buffer = MIN_BUFFER;
+    }
+    while (budget != 0 && plan.memory > budget) {
+        if (plan.threads > 1) {
+            plan.threads--;
+        } else if (plan.block_segments > 1) {
+            plan.block_segments /= 2;
+        } else if (plan.segment_bytes > MIN_BUFFER || plan.output_buffer > MIN_BUFFER) {
+            plan.segment_bytes = (plan.segment_bytes / 2 < MIN_BUFFER) ? MIN_BUFFER : plan.segment_bytes / 2;
+            plan.output_buffer = (plan.output_buffer / 2 < MIN_BUFFER) ? MIN_BUFFER : plan.output_buffer / 2;
+        } else {
+            plan.engine = ENGINE_NONE; // Even the smallest plan does not fit
+            break;
+        }
+        plan.memory = base + plan.output_buffer + plan.threads * worker_memory(&plan, limit);
+    }
+    plan.memory = base + plan.output_buffer + plan.threads * worker_memory(&plan, limit);
+    plan.buffers = 2 * plan.threads;
+    return plan;
+}
+
+/* FUNCTION: estimate the memory of one worker
+ * One segment, the state of the medium primes, the buckets of the large primes (one entry per prime)
+ * and the text of two blocks, estimated for the densest block at the start of the range.
+ */
+size_t worker_memory(const sieve_plan *plan, unsigned long long limit) {
+    uint64_t root = isqrt_u64(limit);
+    uint64_t segment_bits = plan->segment_bytes * 8;
+    uint64_t block_bits = segment_bits * plan->block_segments;
+    uint64_t medium = (root < segment_bits) ? root : segment_bits;
+    size_t state = (size_t)(medium / 2 + 1) * sizeof(medium_prime);
+    size_t buckets = (root > segment_bits) ? (size_t)prime_count_bound(root) * sizeof(bucket_entry) : 0;
+    buckets += (plan->block_segments + 1) * sizeof(bucket_block); // At least one partly filled block per segment
+    double primes = 2.0 * (double)block_bits / log(2.0 * (double)block_bits);
+    size_t digits = (size_t)log10((double)limit) + 2; // Digits and separator
+    size_t text = (size_t)(primes * digits) + OUTPUT_CHUNK;
+    return plan->segment_bytes + state + buckets + 2 * text;
+}
+
+// FUNCTION: number of processors available for the worker threads, within the cgroup limits
+size_t detect_cpu_count() {
+    return detect_resources()->cpus;
+}
+
+// FUNCTION: read the first number of a cgroup file, ULLONG_MAX for "max" or when the file is missing
+static unsigned long long cgroup_value(const char *dir, const char *file) {
+    char path[PATH_MAX + 64]; // Room for the file name after a directory of PATH_MAX
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *fp = fopen(path, "r");
+    unsigned long long value = ULLONG_MAX;
+    if (fp != NULL) {
+        if (fscanf(fp, "%llu", &value) != 1) {
+            value = ULLONG_MAX; // "max" means no limit
+        }
+        fclose(fp);
+    }
+    return value;
+}
+
+// FUNCTION: read the value of key from a cgroup file of "key value" lines, 0 when not found
+static unsigned long long cgroup_stat(const char *dir, const char *file, const char *key) {
+    char path[PATH_MAX + 64], line[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *fp = fopen(path, "r");
+    unsigned long long value = 0;
+    if (fp != NULL) {
+        size_t n = strlen(key);
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (strncmp(line, key, n) == 0 && line[n] == ' ') {
+                value = strtoull(line + n + 1, NULL, 10);
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    return value;
+}
+
+/* FUNCTION: find the directory of this process in a cgroup hierarchy
+ * /proc/self/cgroup has one line per hierarchy, "0::/path" for cgroup v2 and "id:controllers:/path"
+ * for v1. The path is relative to the mount, which for v2 is CGROUP_ROOT itself or its unified
+ * subdirectory in hybrid setups, for v1 the subdirectory of the controller. Inside a cgroup namespace
+ * the path may not exist under the mount, then the mount is the process's own cgroup.
+ */
+static int cgroup_dir(const char *controller, char *dir, size_t size) {
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL) {
+        return EXIT_FAILURE;
+    }
+    char line[PATH_MAX], mount[PATH_MAX];
+    int found = EXIT_FAILURE;
+    while (found != EXIT_SUCCESS && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char *names = strchr(line, ':');
+        char *path = (names != NULL) ? strchr(names + 1, ':') : NULL;
+        if (path == NULL) {
+            continue;
+        }
+        *path++ = '\0';
+        names++;
+        if (controller == NULL && names[0] == '\0') {
+            snprintf(mount, sizeof(mount), "%s/cgroup.controllers", CGROUP_ROOT);
+            if (access(mount, F_OK) == 0) {
+                snprintf(mount, sizeof(mount), "%s", CGROUP_ROOT);
+            } else {
+                snprintf(mount, sizeof(mount), "%s/unified", CGROUP_ROOT); // Hybrid hierarchy
+            }
+            found = EXIT_SUCCESS;
+        } else if (controller != NULL) {
+            for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+                if (strcmp(name, controller) == 0) {
+                    snprintf(mount, sizeof(mount), "%s/%s", CGROUP_ROOT, controller);
+                    found = EXIT_SUCCESS;
+                    break;
+                }
+            }
+        }
+        if (found == EXIT_SUCCESS) {
+            snprintf(dir, size, "%s%s", mount, (strcmp(path, "/") == 0) ? "" : path);
+            if (access(dir, F_OK) != 0) {
+                snprintf(dir, size, "%s", mount);
+            }
+            if (access(dir, F_OK) != 0) {
+                found = EXIT_FAILURE; // Not mounted
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+/* FUNCTION: count the processors of a cpu list such as "0-3,8,10-11", 0 if it cannot be read */
+static size_t count_cpu_list(const char *dir, const char *file) {
+    char path[PATH_MAX + 64], list[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    size_t count = 0;
+    if (fgets(list, sizeof(list), fp) != NULL) {
+        for (char *range = strtok(list, ",\n"); range != NULL; range = strtok(NULL, ",\n")) {
+            unsigned long low, high;
+            int fields = sscanf(range, "%lu-%lu", &low, &high);
+            if (fields == 1) {
+                count++;
+            } else if (fields == 2 && high >= low) {
+                count += high - low + 1;
+            }
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+/* FUNCTION: read the processor and memory limits of this process
+ * Limits of cgroup v2 apply on the whole path to the root, so memory.max, memory.high and cpu.max
+ * are read at every level and the tightest one is taken. The room left under a memory limit is the
+ * limit minus the usage, where inactive file pages count as free as the kernel reclaims them first.
+ * A CPU quota of 1.5 processors gives 2 worker threads, the usual rounding of container runtimes.
+ * Without cgroup v2 the v1 files memory.limit_in_bytes and cpu.cfs_quota_us are used. The result is
+ * kept, the limits are read once per run; --verbose reports them.
+ */
+const resource_limits *detect_resources() {
+    static resource_limits res;
+    static int detected = 0;
+    if (detected) {
+        return &res;
+    }
+    detected = 1;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    res.online = (online > 0) ? (size_t)online : 1;
+    cpu_set_t set;
+    res.affinity = (sched_getaffinity(0, sizeof(set), &set) == 0) ? (size_t)CPU_COUNT(&set) : res.online;
+    res.memory_limit = SIZE_MAX;
+    res.memory_left = SIZE_MAX;
+    char dir[PATH_MAX];
+    if (cgroup_dir(NULL, dir, sizeof(dir)) == EXIT_SUCCESS) {
+        res.cpuset = count_cpu_list(dir, "cpuset.cpus.effective");
+        char level[PATH_MAX];
+        snprintf(level, sizeof(level), "%s", dir);
+        size_t top = strlen(CGROUP_ROOT); // Never walk above the mount
+        for (;;) {
+            unsigned long long max = cgroup_value(level, "memory.max");
+            unsigned long long high = cgroup_value(level, "memory.high");
+            unsigned long long limit = (high < max) ? high : max;
+            if (limit != ULLONG_MAX) {
+                unsigned long long used = cgroup_value(level, "memory.current");
+                unsigned long long inactive = cgroup_stat(level, "memory.stat", "inactive_file");
+                used = (used == ULLONG_MAX) ? 0 : (inactive < used) ? used - inactive : 0;
+                unsigned long long left = (used < limit) ? limit - used : 0;
+                if (limit < res.memory_limit) {
+                    res.memory_limit = (size_t)limit;
+                }
+                if (left < res.memory_left) {
+                    res.memory_left = (size_t)left;
+                }
+            }
+            char path[PATH_MAX + 64];
+            snprintf(path, sizeof(path), "%s/cpu.max", level);
+            FILE *fp = fopen(path, "r");
+            if (fp != NULL) {
+                unsigned long long quota, period;
+                if (fscanf(fp, "%llu %llu", &quota, &period) == 2 && period > 0) {
+                    double cpus = (double)quota / (double)period;
+                    if (res.quota == 0 || cpus < res.quota) {
+                        res.quota = cpus;
+                    }
+                }
+                fclose(fp);
+            }
+            char *slash = strrchr(level, '/');
+            if (slash == NULL || (size_t)(slash - level) < top) {
+                break; // Reached the mount point
+            }
+            *slash = '\0';
+        }
+        if ((res.cpuset > 0 && res.cpuset < res.online) || res.quota > 0 || res.memory_limit != SIZE_MAX) {
+            res.version = 2;
+        }
+    }
+    if (res.memory_limit == SIZE_MAX && cgroup_dir("memory", dir, sizeof(dir)) == EXIT_SUCCESS) {
+        unsigned long long limit = cgroup_value(dir, "memory.limit_in_bytes");
+        if (limit < (ULLONG_MAX >> 2)) { // No limit is shown as a number close to 2^63
+            unsigned long long used = cgroup_value(dir, "memory.usage_in_bytes");
+            unsigned long long inactive = cgroup_stat(dir, "memory.stat", "total_inactive_file");
+            used = (used == ULLONG_MAX) ? 0 : (inactive < used) ? used - inactive : 0;
+            res.memory_limit = (size_t)limit;
+            res.memory_left = (used < limit) ? (size_t)(limit - used) : 0;
+            res.version = (res.version == 0) ? 1 : res.version;
+        }
+    }
+    if (res.quota == 0 && cgroup_dir("cpu", dir, sizeof(dir)) == EXIT_SUCCESS) {
+        long long quota = -1, period;
+        FILE *fp;
+        char path[PATH_MAX + 64];
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+        if ((fp = fopen(path, "r")) != NULL) {
+            if (fscanf(fp, "%lld", &quota) != 1) {
+                quota = -1;
+            }
+            fclose(fp);
+        }
+        period = (long long)cgroup_value(dir, "cpu.cfs_period_us");
+        if (quota > 0 && period > 0) {
+            res.quota = (double)quota / (double)period;
+            res.version = (res.version == 0) ? 1 : res.version;
+        }
+    }
+    res.cpus = res.affinity;
+    if (res.cpuset > 0 && res.cpuset < res.cpus) {
+        res.cpus = res.cpuset;
+    }
+    if (res.quota > 0) {
+        size_t quota_cpus = (size_t)ceil(res.quota - 1e-9);
+        if (quota_cpus < 1) {
+            quota_cpus = 1;
+        }
+        if (quota_cpus < res.cpus) {
+            res.cpus = quota_cpus;
+        }
+    }
+    if (res.cpus < 1) {
+        res.cpus = 1;
+    }
+    if (verbose) {
+        fprintf(stderr, "Resources: %zu processors (%zu online, %zu in the affinity mask", res.cpus, res.online, res.affinity);
+        if (res.cpuset > 0) {
+            fprintf(stderr, ", %zu in the cpuset", res.cpuset);
+        }
+        if (res.quota > 0) {
+            fprintf(stderr, ", quota %.2f", res.quota);
+        }
+        fprintf(stderr, ")");
+        if (res.memory_limit != SIZE_MAX) {
+            fprintf(stderr, ", memory limit %zu bytes with %zu left", res.memory_limit, res.memory_left);
+        }
+        if (res.version > 0) {
+            fprintf(stderr, ", from cgroup v%d", res.version);
+        }
+        fprintf(stderr, "\n");
+    }
+    return &res;
+}
+
+/* FUNCTION: stream the primes up to limit, sieved in blocks in parallel
+ * The range is cut into blocks of plan->block_segments segments. In each round every worker thread
+ * sieves one block into its own text chunks. Meanwhile the calling thread writes the chunks of the
+ * previous round in order; once the round is joined those chunks go back to the workers' pools and are
+ * reused. At most two rounds are in memory, so memory depends on the sieving primes and the pipeline
+ * depth only, not on the limit.
+ */
+int sieve_segmented(unsigned long long limit, const sieve_plan *plan, prime_sink *sink) {
+    if (generate_base_primes(isqrt_u64(limit)) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    phase_mark started = take_mark(&main_counters);
+    sieve_worker *workers = calloc(plan->threads, sizeof(*workers));
+    pthread_t *threads = calloc(plan->threads, sizeof(*threads));
+    if (workers == NULL || threads == NULL) {
+        fprintf(stderr, "Memory allocation failed for worker threads\n");
+        free(workers);
+        free(threads);
+        return EXIT_FAILURE;
+    }
+    for (size_t t = 0; t < plan->threads; t++) {
+        workers[t].plan = plan;
+        workers[t].trace = (trace_file != NULL && t < MAX_THREADS) ? &trace_threads[t + 1] : NULL;
+        workers[t].digests = verify_digests;
+        pool_init(&workers[t].buckets, sizeof(bucket_block), STAT_BUCKETS);
+        pool_init(&workers[t].chunks, sizeof(out_chunk) + OUTPUT_CHUNK, STAT_OUTPUT);
+    }
+    timing_add(TIME_INIT, &started);
+    PROBE3(sieve__start, limit, plan->threads, plan->segment_bytes);
+    int status = EXIT_SUCCESS;
+    if (plan->low <= 2) {
+        sink_put(sink, 2); // The only even prime, the chunks start with a separator
+    }
+    uint64_t end = (limit - 1) / 2 + 1; // One past the index of the largest odd number up to limit
+    uint64_t start = plan->low / 2; // Index of the smallest odd number from low
+    uint64_t block_bits = (uint64_t)plan->segment_bytes * 8 * plan->block_segments;
+
+    // The reporter only reads the counters of the workers, so reporting costs the sieve one relaxed
+    // increment of an unshared cache line per segment
+    progress_reporter reporter;
+    pthread_t reporter_thread;
+    int reporting = 0;
+    if (progress_interval >= 0) {
+        reporter.slots = aligned_alloc(CACHE_LINE, plan->threads * sizeof(progress_slot));
+        if (reporter.slots != NULL) {
+            for (size_t t = 0; t < plan->threads; t++) {
+                atomic_init(&reporter.slots[t].segments, 0);
+                workers[t].progress = &reporter.slots[t];
+            }
+            reporter.threads = plan->threads;
+            reporter.segment_bits = (uint64_t)plan->segment_bytes * 8;
+            reporter.total = (end - start + reporter.segment_bits - 1) / reporter.segment_bits;
+            reporter.started = now_seconds();
+            reporter.interval = progress_interval;
+            atomic_init(&reporter.stop, 0);
+            progress_requested = 0; // Requests from before the sieve were already answered
+            reporting = (pthread_create(&reporter_thread, NULL, progress_thread, &reporter) == 0);
+            progress_active = reporting;
+            if (!reporting) {
+                for (size_t t = 0; t < plan->threads; t++) {
+                    workers[t].progress = NULL;
+                }
+                free(reporter.slots);
+            }
+        }
+    }
+    size_t done = 0; // Workers of the previous round, their text is in done_head
+    do {
+        size_t active = 0;
+        for (; status == EXIT_SUCCESS && active < plan->threads && start < end; active++) {
+            workers[active].first = start;
+            workers[active].end = (end - start > block_bits) ? start + block_bits : end;
+            workers[active].sep = sink->sep;
+            workers[active].count_only = (sink->fp == NULL);
+            start = workers[active].end;
+        }
+        for (size_t t = 0; t < active; t++) {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            if (pin_count > 0) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(pin_cpus[t % pin_count], &set);
+                pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+            }
+            int created = pthread_create(&threads[t], &attr, sieve_block, &workers[t]);
+            pthread_attr_destroy(&attr);
+            if (created != 0) {
+                sieve_block(&workers[t]); // No thread available, sieve the block here
+                threads[t] = pthread_self();
+            }
+        }
+        // Write the previous round in order while this round is sieved
+        started = take_mark(&main_counters);
+        size_t written = 0;
+        for (size_t t = 0; t < done; t++) {
+            for (out_chunk *c = workers[t].done_head; c != NULL; c = c->next) {
+                size_t skip = (sink->first && c->used > 0) ? 1 : 0; // No separator before the first prime of a range
+                fwrite(c->text + skip, 1, c->used - skip, sink->fp);
+                written += c->used - skip;
+                sink->first = 0;
+            }
+        }
+        if (done > 0) {
+            PROBE2(round__write, done, written); // Blocks and bytes of the previous round
+        }
+        timing_add(TIME_IO, &started);
+        for (size_t t = 0; t < active; t++) {
+            if (!pthread_equal(threads[t], pthread_self())) {
+                pthread_join(threads[t], NULL);
+            }
+            counters_close(&workers[t].counters); // The next block may run on another thread
+        }
+        // The workers are idle now, so their pools can take the written chunks back
+        for (size_t t = 0; t < done; t++) {
+            for (out_chunk *c = workers[t].done_head, *next; c != NULL; c = next) {
+                next = c->next;
+                pool_put(&workers[t].chunks, c);
+            }
+            workers[t].done_head = NULL;
+            sink->count += workers[t].done_count;
+        }
+        for (size_t t = 0; t < active; t++) {
+            if (workers[t].failed) {
+                fprintf(stderr, "Memory allocation failed for segment\n");
+                status = EXIT_FAILURE;
+            }
+            workers[t].done_head = workers[t].out_head;
+            workers[t].done_count = workers[t].count;
+            workers[t].out_head = NULL;
+        }
+        done = active;
+    } while (done > 0);
+    PROBE2(sieve__done, limit, sink->count);
+    if (reporting) {
+        progress_active = 0;
+        atomic_store(&reporter.stop, 1);
+        pthread_join(reporter_thread, NULL);
+        free(reporter.slots);
+    }
+    // Keep the times of the workers for the report, the phases get the sum over the threads
+    timed_threads = (plan->threads < MAX_THREADS) ? plan->threads : MAX_THREADS;
+    phase_mark zero = { 0, { 0 } };
+    for (size_t t = 0; t < plan->threads; t++) {
+        for (int k = 0; k < TIME_COUNT; k++) {
+            mark_add(&phase_total[k], &zero, &workers[t].time[k]);
+            if (t < timed_threads) {
+                thread_time[t][k] = workers[t].time[k].seconds;
+            }
+        }
+        for (int k = 0; k < KERNEL_COUNT; k++) {
+            mark_add(&kernel_total[k], &zero, &workers[t].kernel[k]);
+        }
+        if (t < timed_threads) {
+            thread_blocks[t] = workers[t].blocks;
+        }
+        bucket_total += workers[t].bucket_entries;
+    }
+    for (size_t t = 0; t < plan->threads; t++) {
+        arena_free(&workers[t].mem);
+        pool_free(&workers[t].buckets);
+        pool_free(&workers[t].chunks);
+    }
+    free(workers);
+    free(threads);
+    return status;
+}
+
+/* FUNCTION: sieve one block of a worker
+ * Primes are sorted into tiers by their size compared to a segment. Medium primes cross off at least
+ * once per segment and keep their next multiple in an array. Large primes skip whole segments, so
+ * each sits in the bucket of the segment of its next multiple and is only touched there. All memory
+ * comes from the worker's arena, which is reset per block, and from its pools of bucket blocks and
+ * text chunks, so after the first block no malloc is called.
+ */
+void *sieve_block(void *arg) {
+    sieve_worker *w = arg;
+    if (use_counters && w->counters.opened == 0) {
+        counters_open(&w->counters); // Counts this thread, closed by sieve_segmented after the join
+    }
+    phase_mark started = take_mark(&w->counters);
+    size_t segment_bits = w->plan->segment_bytes * 8;
+    int shift = __builtin_ctzll(segment_bits); // The planner keeps segment sizes powers of two
+    uint64_t mask = segment_bits - 1;
+    uint64_t block_bits = w->end - w->first;
+    size_t segments = (size_t)((block_bits + segment_bits - 1) >> shift);
+    uint64_t high = 2 * (w->end - 1) + 1; // Largest number in the block
+    w->count = 0;
+    w->failed = 0;
+    w->blocks++;
+    w->out_head = NULL;
+    w->out_tail = NULL;
+    arena_reset(&w->mem);
+    uint64_t *bits = arena_alloc(&w->mem, w->plan->segment_bytes);
+    size_t medium_max = (base_count < segment_bits / 2 + 1) ? base_count : segment_bits / 2 + 1;
+    medium_prime *medium = arena_alloc(&w->mem, medium_max * sizeof(*medium) + 1);
+    bucket_block **bucket = arena_alloc(&w->mem, segments * sizeof(*bucket));
+    if (bits == NULL || medium == NULL || bucket == NULL) {
+        w->failed = 1;
+        return NULL;
+    }
+    memset(bucket, 0, segments * sizeof(*bucket));
+
+    // First multiple of every sieving prime in the block, skipping 2 as there are no even numbers
+    size_t medium_count = 0;
+    size_t pending = base_count; // First medium prime whose square lies past segment 0 of the block
+    uint64_t low = 2 * w->first + 1; // Smallest number in the block
+    for (size_t k = 1; k < base_count; k++) {
+        uint64_t p = base_primes[k];
+        if (p * p > high) {
+            break;
+        }
+        uint64_t m = (low + p - 1) / p * p;
+        if (m < p * p) {
+            m = p * p; // Smaller multiples are already crossed out by smaller primes
+        }
+        if (m % 2 == 0) {
+            m += p; // Only odd multiples are stored
+        }
+        uint64_t offset = (m - 1) / 2 - w->first; // Below block_bits, as p * p is in the block
+        if (p < segment_bits) {
+            if (offset >= segment_bits) {
+                if (pending == base_count) {
+                    pending = k; // Added by the segment holding p * p, as squares grow with p
+                }
+                continue;
+            }
+            medium[medium_count].prime = (uint32_t)p;
+            medium[medium_count].offset = (uint32_t)offset;
+            medium_count++;
+        } else if (offset < block_bits && bucket_push(w, &bucket[offset >> shift], (uint32_t)p, (uint32_t)(offset & mask)) != EXIT_SUCCESS) {
+            return NULL;
+        }
+    }
+
+    for (size_t s = 0; s < segments; s++) {
+        uint64_t first = w->first + (uint64_t)s * segment_bits;
+        size_t nbits = (w->end - first < segment_bits) ? (size_t)(w->end - first) : segment_bits;
+        size_t words = (nbits + 63) / 64;
+        memset(bits, 0, words * sizeof(uint64_t));
+        if (nbits % 64 != 0) {
+            bits[words - 1] = ~((UINT64_C(1) << (nbits % 64)) - 1); // Cross out bits past the end of the segment
+        }
+        if (first == 0) {
+            bits[0] |= UINT64_C(1); // 1 is not prime
+        }
+        PROBE3(segment__start, 2 * first + 1, nbits, w->blocks);
+        // Medium primes start at their square, so store that offset relative to its own segment
+        for (; pending < base_count && base_primes[pending] < segment_bits; pending++) {
+            uint64_t p = base_primes[pending];
+            uint64_t offset = (p * p - 1) / 2 - w->first;
+            if (p * p > high || (offset >> shift) != s) {
+                break;
+            }
+            medium[medium_count].prime = (uint32_t)p;
+            medium[medium_count].offset = (uint32_t)(offset & mask);
+            medium_count++;
+        }
+        phase_mark medium_start = take_mark(&w->counters);
+        sieve_medium(bits, nbits, medium, medium_count);
+        phase_mark bucket_start = take_mark(&w->counters);
+        mark_add(&w->kernel[KERNEL_MEDIUM], &medium_start, &bucket_start);
+        if (sieve_bucket(w, bits, bucket, s, shift, block_bits) != EXIT_SUCCESS) {
+            return NULL;
+        }
+        PROBE2(segment__done, 2 * first + 1, nbits);
+        if (w->digests != NULL) {
+            w->digests[first >> shift] = segment_digest(bits, words);
+        }
+        if (w->progress != NULL) {
+            atomic_fetch_add_explicit(&w->progress->segments, 1, memory_order_relaxed);
+        }
+        phase_mark sieved = take_mark(&w->counters);
+        mark_add(&w->kernel[KERNEL_BUCKET], &bucket_start, &sieved);
+        mark_add(&w->time[TIME_SIEVE], &started, &sieved);
+        if (w->trace != NULL) {
+            trace_add(w->trace, TIME_SIEVE, started.seconds, sieved.seconds, 2 * first + 1);
+        }
+        // Format the primes of the segment, or only count them
+        if (w->count_only) {
+            for (size_t k = 0; k < words; k++) {
+                w->count += (unsigned long long)__builtin_popcountll(~bits[k]);
+            }
+            started = take_mark(&w->counters);
+            mark_add(&w->time[TIME_EXTRACT], &sieved, &started);
+            if (w->trace != NULL) {
+                trace_add(w->trace, TIME_EXTRACT, sieved.seconds, started.seconds, 2 * first + 1);
+            }
+            continue;
+        }
+        for (size_t k = 0; k < words; k++) {
+            uint64_t word = ~bits[k]; // Set bits are the primes
+            while (word != 0) {
+                if (w->out_tail == NULL || w->out_tail->used + 22 > OUTPUT_CHUNK) {
+                    out_chunk *c = pool_get(&w->chunks);
+                    if (c == NULL) {
+                        w->failed = 1;
+                        return NULL;
+                    }
+                    c->next = NULL;
+                    c->used = 0;
+                    if (w->out_tail == NULL) {
+                        w->out_head = c;
+                    } else {
+                        w->out_tail->next = c;
+                    }
+                    w->out_tail = c;
+                }
+                char *text = w->out_tail->text + w->out_tail->used;
+                *text = w->sep;
+                w->out_tail->used += 1 + format_u64(text + 1, 2 * (first + k * 64 + (uint64_t)__builtin_ctzll(word)) + 1);
+                w->count++;
+                word &= word - 1; // Clear the lowest set bit
+            }
+        }
+        started = take_mark(&w->counters);
+        mark_add(&w->time[TIME_FORMAT], &sieved, &started);
+        if (w->trace != NULL) {
+            trace_add(w->trace, TIME_FORMAT, sieved.seconds, started.seconds, 2 * first + 1);
+        }
+    }
+    return NULL;
+}
+
+// FUNCTION: cross off the medium primes in a segment of nbits bits and move their offsets to the next segment
+void sieve_medium(uint64_t *bits, size_t nbits, medium_prime *medium, size_t count) {
+    for (size_t k = 0; k < count; k++) {
+        uint64_t p = medium[k].prime;
+        uint64_t j = medium[k].offset;
+        for (; j < nbits; j += p) {
+            bits[j / 64] |= UINT64_C(1) << (j % 64); // Mark multiple as not prime
+        }
+        medium[k].offset = (uint32_t)(j - nbits); // Relative to the next segment
+    }
+}
+
+/* FUNCTION: cross off the large primes in the bucket of segment s of a block
+ * Each entry crosses off once and moves on to the bucket of its next segment, unless that is past the
+ * end of the block (block_bits). Every entry hits a random word of the segment, so the word of the entry
+ * `distance` places ahead is prefetched, as well as the entries themselves and the next block of the
+ * bucket. Emptied bucket blocks go back to the pool right away.
+ */
+int sieve_bucket(sieve_worker *w, uint64_t *bits, bucket_block **bucket, size_t s, int shift, uint64_t block_bits) {
+    uint64_t mask = (UINT64_C(1) << shift) - 1;
+    size_t distance = w->plan->prefetch;
+    bucket_block *b = bucket[s];
+    while (b != NULL) {
+        if (distance > 0 && b->next != NULL) {
+            __builtin_prefetch(b->next, 0, 3);
+        }
+        for (size_t e = 0; e < b->used; e++) {
+            if (distance > 0 && e + distance < b->used) {
+                __builtin_prefetch(&bits[b->entries[e + distance].offset / 64], 1, 3);
+                if (e + 2 * distance < b->used) {
+                    __builtin_prefetch(&b->entries[e + 2 * distance], 0, 3);
+                }
+            }
+            uint32_t p = b->entries[e].prime;
+            uint64_t j = b->entries[e].offset;
+            bits[j / 64] |= UINT64_C(1) << (j % 64); // Mark multiple as not prime
+            uint64_t next = ((uint64_t)s << shift) + j + p; // Relative to the block
+            if (next < block_bits && bucket_push(w, &bucket[next >> shift], p, (uint32_t)(next & mask)) != EXIT_SUCCESS) {
+                bucket[s] = b;
+                return EXIT_FAILURE;
+            }
+        }
+        w->bucket_entries += b->used;
+        bucket_block *next = b->next;
+        pool_put(&w->buckets, b); // Recycle the bucket block right away
+        b = next;
+    }
+    bucket[s] = NULL;
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: add a large prime to a bucket, taking a new bucket block from the pool when it is full
+int bucket_push(sieve_worker *w, bucket_block **bucket, uint32_t prime, uint32_t offset) {
+    bucket_block *b = *bucket;
+    if (b == NULL || b->used == BUCKET_ENTRIES) {
+        b = pool_get(&w->buckets);
+        if (b == NULL) {
+            w->failed = 1;
+            return EXIT_FAILURE;
+        }
+        PROBE2(bucket__refill, prime, offset);
+        b->next = *bucket;
+        b->used = 0;
+        *bucket = b;
+    }
+    b->entries[b->used].prime = prime;
+    b->entries[b->used].offset = offset;
+    b->used++;
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: write the decimal digits of value to text, returns the number of characters
+size_t format_u64(char *text, uint64_t value) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    for (size_t k = 0; k < n; k++) {
+        text[k] = digits[n - 1 - k];
+    }
+    return n;
+}
+
+// FUNCTION: write the decimal digits of value to text two at a time from a table, returns the number of characters
+size_t format_table(char *text, uint64_t value) {
+    static const char pairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char digits[20];
+    size_t n = 20;
+    while (value >= 100) {
+        const char *pair = pairs + 2 * (value % 100);
+        value /= 100;
+        digits[--n] = pair[1];
+        digits[--n] = pair[0];
+    }
+    if (value >= 10) {
+        digits[--n] = pairs[2 * value + 1];
+        digits[--n] = pairs[2 * value];
+    } else {
+        digits[--n] = (char)('0' + value);
+    }
+    memcpy(text, digits + n, 20 - n);
+    return 20 - n;
+}
+
+/* FUNCTION: write the decimal digits of value to text by adding the gap to the previous number
+ * digits holds the text of previous right aligned in 20 characters, length its digits. The gap between
+ * consecutive primes is small, so usually only the last two or three digits change. Numbers below the
+ * previous one start over with format_table.
+ */
+size_t format_increment(char *text, uint64_t value, char *digits, size_t *length, uint64_t *previous) {
+    if (value < *previous || *length == 0) {
+        *length = format_table(digits, value);
+        memmove(digits + 20 - *length, digits, *length);
+    } else {
+        uint64_t carry = value - *previous;
+        size_t i = 20;
+        while (carry != 0) {
+            i--;
+            uint64_t sum = (i >= 20 - *length) ? (uint64_t)(digits[i] - '0') + carry : carry;
+            digits[i] = (char)('0' + sum % 10);
+            carry = sum / 10;
+        }
+        if (20 - i > *length) {
+            *length = 20 - i;
+        }
+    }
+    *previous = value;
+    memcpy(text, digits + 20 - *length, *length);
+    return *length;
+}
+
+// FUNCTION: open the output file of a writer, returns EXIT_FAILURE if the backend is not available
+int writer_open(out_writer *wr, int kind, const char *path) {
+    memset(wr, 0, sizeof(*wr));
+    wr->kind = kind;
+    wr->fd = -1;
+    if (kind == WRITER_NONE) {
+        return EXIT_SUCCESS;
+    }
+    if (kind == WRITER_STDIO) {
+        wr->fp = fopen(path, "w");
+        if (wr->fp == NULL) {
+            return EXIT_FAILURE;
+        }
+        setvbuf(wr->fp, NULL, _IOFBF, OUTPUT_BUFFER);
+        return EXIT_SUCCESS;
+    }
+    int flags = O_CREAT | O_TRUNC | ((kind == WRITER_MMAP) ? O_RDWR : O_WRONLY);
+#ifdef O_DIRECT
+    if (kind == WRITER_DIRECT) {
+        flags |= O_DIRECT;
+    }
+#else
+    if (kind == WRITER_DIRECT) {
+        return EXIT_FAILURE;
+    }
+#endif
+    wr->fd = open(path, flags, 0644);
+    return (wr->fd < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* FUNCTION: write a block of text
+ * n is a multiple of DIRECT_ALIGN and data is aligned to it, as O_DIRECT requires. The mmap writer
+ * grows the file and maps it MMAP_WINDOW bytes at a time.
+ */
+int writer_put(out_writer *wr, const char *data, size_t n) {
+    switch (wr->kind) {
+    case WRITER_NONE:
+        break;
+    case WRITER_STDIO:
+        if (fwrite(data, 1, n, wr->fp) != n) {
+            return EXIT_FAILURE;
+        }
+        break;
+    case WRITER_MMAP:
+        while (n > 0) {
+            if (wr->map == NULL || wr->written == wr->map_start + MMAP_WINDOW) {
+                if (wr->map != NULL) {
+                    munmap(wr->map, MMAP_WINDOW);
+                }
+                wr->map_start = wr->written;
+                if (ftruncate(wr->fd, (off_t)(wr->map_start + MMAP_WINDOW)) != 0) {
+                    return EXIT_FAILURE;
+                }
+                wr->map = mmap(NULL, MMAP_WINDOW, PROT_WRITE, MAP_SHARED, wr->fd, (off_t)wr->map_start);
+                if (wr->map == MAP_FAILED) {
+                    wr->map = NULL;
+                    return EXIT_FAILURE;
+                }
+            }
+            size_t room = wr->map_start + MMAP_WINDOW - wr->written;
+            size_t part = (n < room) ? n : room;
+            memcpy(wr->map + (wr->written - wr->map_start), data, part);
+            wr->written += part;
+            data += part;
+            n -= part;
+        }
+        return EXIT_SUCCESS;
+    default:
+        while (n > 0) {
+            ssize_t done = write(wr->fd, data, n);
+            if (done <= 0) {
+                return EXIT_FAILURE;
+            }
+            data += done;
+            n -= (size_t)done;
+            wr->written += (size_t)done;
+        }
+        return EXIT_SUCCESS;
+    }
+    wr->written += n;
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: write the last n bytes, which need not fill an aligned block, and close the file
+int writer_close(out_writer *wr, const char *tail, size_t n) {
+    int status = EXIT_SUCCESS;
+    if (wr->kind == WRITER_DIRECT && n > 0) {
+        fcntl(wr->fd, F_SETFL, fcntl(wr->fd, F_GETFL) & ~O_DIRECT); // The tail is not a whole block
+    }
+    if (wr->kind == WRITER_MMAP) {
+        status = writer_put(wr, tail, n);
+        if (wr->map != NULL) {
+            munmap(wr->map, MMAP_WINDOW);
+        }
+        if (ftruncate(wr->fd, (off_t)wr->written) != 0) {
+            status = EXIT_FAILURE; // Cut off the rest of the last window
+        }
+    } else if (n > 0) {
+        status = writer_put(wr, tail, n);
+    }
+    if (wr->fp != NULL && fclose(wr->fp) != 0) {
+        status = EXIT_FAILURE;
+    }
+    if (wr->fd >= 0) {
+        close(wr->fd);
+    }
+    return status;
+}
+
+/* FUNCTION: allocate from an arena
+ * Memory is handed out from a list of chunks by moving a pointer. A chunk is only allocated when the
+ * existing ones are full, so once the arena has seen its largest round it never calls malloc again.
+ * Returns memory aligned to a cache line, or NULL when out of memory.
+ */
+void *arena_alloc(arena *a, size_t size) {
+    size = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    while (a->current != NULL && a->current->used + size > a->current->size) {
+        a->current = a->current->next; // Try the next chunk, kept from an earlier round
+    }
+    if (a->current == NULL) {
+        size_t chunk_size = (size > ARENA_CHUNK) ? size : ARENA_CHUNK;
+        arena_chunk *c = malloc(sizeof(arena_chunk) + chunk_size + CACHE_LINE);
+        if (c == NULL) {
+            return NULL;
+        }
+        c->size = chunk_size;
+        c->used = 0;
+        c->next = NULL;
+        // Append, so that earlier chunks are tried first after a reset
+        arena_chunk **tail = &a->first;
+        while (*tail != NULL) {
+            tail = &(*tail)->next;
+        }
+        *tail = c;
+        a->current = c;
+        a->allocated += chunk_size;
+        stats_alloc(STAT_SEGMENTS, chunk_size);
+    }
+    arena_chunk *c = a->current;
+    char *data = (char *)(c + 1);
+    data += (CACHE_LINE - (uintptr_t)data % CACHE_LINE) % CACHE_LINE;
+    void *result = data + c->used;
+    c->used += size;
+    return result;
+}
+
+// FUNCTION: release everything allocated from an arena at once, keeping its chunks for reuse
+void arena_reset(arena *a) {
+    for (arena_chunk *c = a->first; c != NULL; c = c->next) {
+        c->used = 0;
+    }
+    a->current = a->first;
+}
+
+// FUNCTION: return the chunks of an arena to the system
+void arena_free(arena *a) {
+    for (arena_chunk *c = a->first, *next; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+    stats_free(STAT_SEGMENTS, a->allocated);
+    a->first = NULL;
+    a->current = NULL;
+    a->allocated = 0;
+}
+
+// FUNCTION: prepare a pool of fixed size blocks
+void pool_init(block_pool *pool, size_t block_size, int category) {
+    pool->block_size = (block_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->allocated = 0;
+    pool->category = category;
+}
+
+/* FUNCTION: take a block from a pool
+ * Blocks come from the free list. Only when it is empty a new slab of POOL_SLAB_BLOCKS blocks is
+ * allocated and threaded onto the free list.
+ */
+void *pool_get(block_pool *pool) {
+    if (pool->free_list == NULL) {
+        PROBE2(pool__miss, pool->category, pool->allocated);
+        pool_slab *slab = malloc(sizeof(pool_slab) + CACHE_LINE + POOL_SLAB_BLOCKS * pool->block_size);
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->allocated += POOL_SLAB_BLOCKS * pool->block_size;
+        stats_alloc(pool->category, POOL_SLAB_BLOCKS * pool->block_size);
+        char *data = (char *)(slab + 1);
+        data += (CACHE_LINE - (uintptr_t)data % CACHE_LINE) % CACHE_LINE;
+        for (size_t k = 0; k < POOL_SLAB_BLOCKS; k++) {
+            pool_put(pool, data + k * pool->block_size);
+        }
+    }
+    PROBE1(pool__get, pool->category);
+    free_block *block = pool->free_list;
+    pool->free_list = block->next;
+    return block;
+}
+
+// FUNCTION: return a block to its pool
+void pool_put(block_pool *pool, void *block) {
+    free_block *b = block;
+    b->next = pool->free_list;
+    pool->free_list = b;
+}
+
+// FUNCTION: return the slabs of a pool to the system
+void pool_free(block_pool *pool) {
+    for (pool_slab *s = pool->slabs, *next; s != NULL; s = next) {
+        next = s->next;
+        free(s);
+    }
+    stats_free(pool->category, pool->allocated);
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->allocated = 0;
+}
+
+// FUNCTION: open the output sink, the CSV file when a filename is given and stdout otherwise
+int open_sink(prime_sink *sink, const char *filename, size_t buffer) {
+    sink->fp = stdout;
+    sink->sep = ' ';
+    sink->first = 1;
+    sink->count = 0;
+    sink->buffer.ptr = NULL;
+    if (filename != NULL) {
+        sink->fp = fopen(filename, "w");
+        sink->sep = ',';
+        if (sink->fp == NULL) {
+            fprintf(stderr, "Failed to open file %s for writing\n", filename);
+            return EXIT_FAILURE;
+        }
+        // Buffer size chosen by the planner, without a buffer stdio allocates its own default one
+        if (big_alloc(&sink->buffer, buffer, "output buffer", STAT_OUTPUT) == EXIT_SUCCESS) {
+            setvbuf(sink->fp, sink->buffer.ptr, _IOFBF, buffer);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: end the line and close the output sink
+void close_sink(prime_sink *sink) {
+    PROBE1(sink__close, sink->count);
+    fprintf(sink->fp, "\n");
+    if (sink->fp != stdout) {
+        fclose(sink->fp);
+        big_free(&sink->buffer); // Only after fclose, stdio uses it until then
+    }
+}
+
+/* FUNCTION: allocate a large buffer
+ * Buffers of at least HUGE_PAGE_SIZE are mapped directly to cut TLB misses: with --hugepages from the
+ * hugetlbfs pool (1 GiB pages for buffers of 1 GiB and more, else 2 MiB pages), otherwise or when the
+ * pool is empty as an aligned anonymous mapping advised to use transparent huge pages. When mmap fails,
+ * or for small buffers, calloc is used. The memory is zero filled: fresh mappings get the kernel's zero
+ * pages, which are only replaced by real pages when written, so no pass over the memory is needed.
+ */
+int big_alloc(big_buffer *buf, size_t size, const char *name, int category) {
+    buf->ptr = NULL;
+    buf->size = size;
+    buf->mapped = 0;
+    buf->name = name;
+    buf->category = category;
+    stats_alloc(category, size); // Counted up front, undone below if every attempt fails
+    if (size >= HUGE_PAGE_SIZE) {
+        size_t rounded = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        if (use_hugetlb) {
+            size_t giant = (size_t)1 << 30;
+            size_t rounded_1g = (size + giant - 1) / giant * giant;
+            void *p = MAP_FAILED;
+            if (size >= giant) {
+                p = mmap(NULL, rounded_1g, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+                if (p != MAP_FAILED) {
+                    buf->ptr = p;
+                    buf->mapped = rounded_1g;
+                    buf->backing = BACKING_HUGE_1G;
+                    return EXIT_SUCCESS;
+                }
+            }
+            p = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+            if (p != MAP_FAILED) {
+                buf->ptr = p;
+                buf->mapped = rounded;
+                buf->backing = BACKING_HUGE_2M;
+                return EXIT_SUCCESS;
+            }
+        }
+        // Map one huge page extra, so the start can be aligned to a huge page boundary
+        char *p = mmap(NULL, rounded + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            size_t head = (HUGE_PAGE_SIZE - (uintptr_t)p % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+            if (head > 0) {
+                munmap(p, head);
+            }
+            munmap(p + head + rounded, HUGE_PAGE_SIZE - head);
+            buf->ptr = p + head;
+            buf->mapped = rounded;
+            buf->backing = (madvise(buf->ptr, rounded, MADV_HUGEPAGE) == 0) ? BACKING_THP : BACKING_PAGES;
+            return EXIT_SUCCESS;
+        }
+    }
+    buf->ptr = calloc(size, 1);
+    buf->backing = BACKING_MALLOC;
+    if (buf->ptr == NULL) {
+        stats_free(category, size);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: release a large buffer, with --verbose report how it was backed
+void big_free(big_buffer *buf) {
+    static const char *backings[] = { "malloc", "4 KiB pages", "transparent huge pages", "2 MiB hugetlbfs pages", "1 GiB hugetlbfs pages" };
+    if (buf->ptr == NULL) {
+        return;
+    }
+    if (verbose) {
+        fprintf(stderr, "Memory backing: %s of %.1f KiB uses %s", buf->name, buf->size / 1024.0, backings[buf->backing]);
+        if (buf->backing == BACKING_THP) {
+            // The advice is only a hint, the kernel decides which parts actually got huge pages
+            fprintf(stderr, " (%.1f KiB in huge pages)", huge_page_bytes(buf->ptr) / 1024.0);
+        }
+        fprintf(stderr, "\n");
+    }
+    if (buf->mapped != 0) {
+        munmap(buf->ptr, buf->mapped);
+    } else {
+        free(buf->ptr);
+    }
+    stats_free(buf->category, buf->size);
+    buf->ptr = NULL;
+}
+
+// FUNCTION: amount of transparent huge pages in the mapping starting at ptr, from /proc/self/smaps
+size_t huge_page_bytes(const void *ptr) {
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[256];
+    int inside = 0; // Non-zero while reading the fields of the mapping at ptr
+    unsigned long long kib = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long long start, end;
+        if (sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+            inside = (start <= (uintptr_t)ptr && (uintptr_t)ptr < end);
+        } else if (inside && sscanf(line, "AnonHugePages: %llu kB", &kib) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return (size_t)kib * 1024;
+}
+
+// FUNCTION: count an allocation of bytes in a category, safe to call from the worker threads
+void stats_alloc(int category, size_t bytes) {
+    atomic_fetch_add_explicit(&stat_allocated[category], bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_calls[category], 1, memory_order_relaxed);
+    size_t live = atomic_fetch_add_explicit(&stat_live[category], bytes, memory_order_relaxed) + bytes;
+    size_t peak = atomic_load_explicit(&stat_peak[category], memory_order_relaxed);
+    while (live > peak && !atomic_compare_exchange_weak_explicit(&stat_peak[category], &peak, live,
+                                                                 memory_order_relaxed, memory_order_relaxed)) {
+        // peak was reloaded by the failed exchange, try again while live is still larger
+    }
+}
+
+// FUNCTION: count the release of bytes in a category
+void stats_free(int category, size_t bytes) {
+    atomic_fetch_sub_explicit(&stat_live[category], bytes, memory_order_relaxed);
+}
+
+/* FUNCTION: print the memory statistics
+ * Peak resident memory and page faults come from getrusage, the bytes per phase from the counters of
+ * our own allocators. With --stats a table goes to stderr, with --stats-json a JSON object to the file.
+ */
+void report_stats() {
+    static const char *names[STAT_COUNT] = { "base_primes", "sieve", "segments", "buckets", "output", "prefix_sums" };
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &usage);
+    unsigned long long peak_rss = (unsigned long long)usage.ru_maxrss * 1024; // ru_maxrss is in KiB on Linux
+    if (show_stats) {
+        fprintf(stderr, "Memory statistics:\n");
+        fprintf(stderr, "  peak resident memory : %llu bytes\n", peak_rss);
+        fprintf(stderr, "  page faults          : %ld minor, %ld major\n", usage.ru_minflt, usage.ru_majflt);
+        fprintf(stderr, "  %-12s %16s %16s %12s\n", "phase", "allocated", "peak", "allocations");
+        for (int k = 0; k < STAT_COUNT; k++) {
+            fprintf(stderr, "  %-12s %16zu %16zu %12zu\n", names[k], atomic_load(&stat_allocated[k]),
+                    atomic_load(&stat_peak[k]), atomic_load(&stat_calls[k]));
+        }
+    }
+    if (stats_json != NULL) {
+        FILE *fp = fopen(stats_json, "w");
+        if (!fp) {
+            fprintf(stderr, "Failed to open file %s for writing\n", stats_json);
+            return;
+        }
+        fprintf(fp, "{\"peak_rss_bytes\": %llu, \"minor_page_faults\": %ld, \"major_page_faults\": %ld, \"phases\": {",
+                peak_rss, usage.ru_minflt, usage.ru_majflt);
+        for (int k = 0; k < STAT_COUNT; k++) {
+            fprintf(fp, "%s\"%s\": {\"allocated_bytes\": %zu, \"peak_bytes\": %zu, \"allocations\": %zu}",
+                    (k > 0) ? ", " : "", names[k], atomic_load(&stat_allocated[k]),
+                    atomic_load(&stat_peak[k]), atomic_load(&stat_calls[k]));
+        }
+        fprintf(fp, "}}\n");
+        fclose(fp);
+    }
+}
+
+// FUNCTION: read the monotonic clock in seconds
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// FUNCTION: add the time and counters since started to a phase, only called by the main thread
+void timing_add(int phase, const phase_mark *started) {
+    phase_mark now = take_mark(&main_counters);
+    mark_add(&phase_total[phase], started, &now);
+    if (trace_file != NULL) {
+        trace_add(&trace_threads[0], phase, started->seconds, now.seconds, 0);
+    }
+}
+
+// FUNCTION: read the clock and, when open, the hardware counters of the calling thread
+phase_mark take_mark(const counter_group *group) {
+    phase_mark mark = { now_seconds(), { 0 } };
+    if (group->opened > 0) {
+        uint64_t values[3 + EVENT_COUNT]; // Count, time enabled, time running and one value per event
+        if (read(group->leader, values, sizeof(values)) >= (ssize_t)(3 * sizeof(uint64_t))) {
+            // When the group shared the counters with others, extrapolate to the time it was enabled
+            double scale = (values[2] > 0 && values[2] < values[1]) ? (double)values[1] / values[2] : 1.0;
+            for (int k = 0; k < EVENT_COUNT; k++) {
+                if (group->slot[k] >= 0 && (uint64_t)group->slot[k] < values[0]) {
+                    mark.events[k] = (unsigned long long)(values[3 + group->slot[k]] * scale);
+                }
+            }
+        }
+    }
+    return mark;
+}
+
+// FUNCTION: add the difference between two marks to a total
+void mark_add(phase_mark *total, const phase_mark *from, const phase_mark *to) {
+    total->seconds += to->seconds - from->seconds;
+    for (int k = 0; k < EVENT_COUNT; k++) {
+        total->events[k] += (to->events[k] > from->events[k]) ? to->events[k] - from->events[k] : 0;
+    }
+}
+
+/* FUNCTION: open the hardware counters of the calling thread
+ * The events are opened as one group, so one read returns all of them for the same interval. Only user
+ * space is counted, which perf_event_paranoid allows up to level 2. Events the processor or the kernel
+ * does not offer are left out; if none can be opened, counters_error tells why and EXIT_FAILURE is
+ * returned, and the marks then only hold times.
+ */
+int counters_open(counter_group *group) {
+    static const uint32_t types[EVENT_COUNT] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                                 PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+    static const uint64_t configs[EVENT_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+    group->opened = 0;
+    group->leader = -1;
+    for (int k = 0; k < EVENT_COUNT; k++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[k];
+        attr.config = configs[k];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        group->fd[k] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group->leader, PERF_FLAG_FD_CLOEXEC);
+        group->slot[k] = -1;
+        if (group->fd[k] < 0) {
+            if (counters_error == NULL) {
+                counters_error = (errno == EACCES || errno == EPERM) ? "not permitted, see /proc/sys/kernel/perf_event_paranoid"
+                               : (errno == ENOENT || errno == EOPNOTSUPP) ? "not supported by this processor or virtual machine"
+                               : (errno == ENOSYS) ? "perf_event_open is not available" : "perf_event_open failed";
+            }
+            continue;
+        }
+        if (group->leader < 0) {
+            group->leader = group->fd[k];
+        }
+        group->slot[k] = group->opened++;
+    }
+    return (group->opened > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// FUNCTION: close the hardware counters
+void counters_close(counter_group *group) {
+    if (group->opened == 0) {
+        return;
+    }
+    for (int k = 0; k < EVENT_COUNT; k++) {
+        if (group->slot[k] >= 0) {
+            close(group->fd[k]);
+        }
+    }
+    group->opened = 0;
+}
+
+/* FUNCTION: print the phase timings
+ * Times of the worker threads are summed per phase, so with several threads the phases can add up to
+ * more than the wall time. Time spent waiting for input at the prompts is only part of the total.
+ */
+void report_timing() {
+    const char **names = phase_names;
+    static const char *kernels[KERNEL_COUNT] = { "medium_primes", "bucket_primes" };
+    fprintf(stderr, "Timing (monotonic clock):\n");
+    for (int k = 0; k < TIME_COUNT; k++) {
+        fprintf(stderr, "  %-16s %12.6f s\n", names[k], phase_total[k].seconds);
+    }
+    for (int k = 0; k < KERNEL_COUNT; k++) {
+        fprintf(stderr, "  %-16s %12.6f s (part of sieving)\n", kernels[k], kernel_total[k].seconds);
+    }
+    fprintf(stderr, "  %-16s %12.6f s\n", "total (wall)", now_seconds() - program_start);
+    for (size_t t = 0; t < timed_threads; t++) {
+        fprintf(stderr, "  thread %-4zu %6zu blocks, sieving %.6f s, extraction %.6f s, formatting %.6f s\n", t,
+                thread_blocks[t], thread_time[t][TIME_SIEVE], thread_time[t][TIME_EXTRACT], thread_time[t][TIME_FORMAT]);
+    }
+    if (!use_counters || main_counters.opened == 0) {
+        return; // Already told at the start why the counters are missing
+    }
+    fprintf(stderr, "Hardware counters (user space, missing events show 0):\n");
+    fprintf(stderr, "  %-16s %14s %14s %6s %12s %12s %12s %12s\n", "phase", "cycles", "instructions", "IPC",
+            "L1d misses", "LLC misses", "br. misses", "dTLB misses");
+    for (int k = 0; k < TIME_COUNT + KERNEL_COUNT; k++) {
+        const phase_mark *m = (k < TIME_COUNT) ? &phase_total[k] : &kernel_total[k - TIME_COUNT];
+        const unsigned long long *e = m->events;
+        fprintf(stderr, "  %-16s %14llu %14llu %6.2f %12llu %12llu %12llu %12llu\n",
+                (k < TIME_COUNT) ? names[k] : kernels[k - TIME_COUNT], e[EVENT_CYCLES], e[EVENT_INSTRUCTIONS],
+                (e[EVENT_CYCLES] > 0) ? (double)e[EVENT_INSTRUCTIONS] / e[EVENT_CYCLES] : 0.0,
+                e[EVENT_L1D_MISSES], e[EVENT_LLC_MISSES], e[EVENT_BRANCH_MISSES], e[EVENT_DTLB_MISSES]);
+    }
+    counters_close(&main_counters);
+}
+
+// FUNCTION: record a trace event, called only by the thread that owns the buffer
+void trace_add(trace_buffer *buffer, int phase, double start, double end, uint64_t first) {
+    if (buffer->count == buffer->capacity) {
+        size_t capacity = (buffer->capacity == 0) ? 4096 : 2 * buffer->capacity;
+        trace_event *events = (capacity <= TRACE_MAX_EVENTS) ? realloc(buffer->events, capacity * sizeof(*events)) : NULL;
+        if (events == NULL) {
+            buffer->dropped++;
+            return;
+        }
+        buffer->events = events;
+        buffer->capacity = capacity;
+    }
+    buffer->events[buffer->count++] = (trace_event){ start, end, first, phase };
+}
+
+/* FUNCTION: write the trace in Chrome trace event format
+ * Every event becomes a complete event ("ph": "X") with its start and duration in microseconds since
+ * the program started. Thread 0 is the main thread (setup, base primes and the writes of every round),
+ * threads 1 and up are the workers with the sieving, extraction and formatting of every segment. The
+ * file opens in chrome://tracing or ui.perfetto.dev.
+ */
+void write_trace() {
+    FILE *fp = fopen(trace_file, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for writing\n", trace_file);
+        return;
+    }
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"eratos3\"}}");
+    size_t dropped = 0;
+    for (size_t t = 0; t <= MAX_THREADS; t++) {
+        trace_buffer *buffer = &trace_threads[t];
+        if (buffer->count == 0) {
+            continue;
+        }
+        fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": ", t);
+        if (t == 0) {
+            fprintf(fp, "\"main\"}}");
+        } else {
+            fprintf(fp, "\"worker %zu\"}}", t - 1);
+        }
+        for (size_t k = 0; k < buffer->count; k++) {
+            const trace_event *e = &buffer->events[k];
+            fprintf(fp, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, "
+                        "\"ts\": %.3f, \"dur\": %.3f",
+                    phase_names[e->phase], (t == 0) ? "phase" : "segment", t, (e->start - program_start) * 1e6,
+                    (e->end - e->start) * 1e6);
+            if (e->first != 0) {
+                fprintf(fp, ", \"args\": {\"first\": %llu}", (unsigned long long)e->first);
+            }
+            fprintf(fp, "}");
+        }
+        dropped += buffer->dropped;
+        free(buffer->events);
+        buffer->events = NULL;
+        buffer->count = buffer->capacity = 0;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    if (dropped > 0) {
+        fprintf(stderr, "Trace: %zu events dropped after %u per thread\n", dropped, TRACE_MAX_EVENTS);
+    }
+}
+
+/* FUNCTION: request a progress report
+ * While the segmented sieve runs this only sets a flag for the reporter thread. Any other time there
+ * are no counters to report, which is said with write, as stdio is not safe in a signal handler.
+ */
+void progress_signal(int signum) {
+    static const char none[] = "Progress: no progress available outside the segmented sieve\n";
+    (void)signum;
+    if (progress_active) {
+        progress_requested = 1;
+    } else {
+        ssize_t ignored = write(STDERR_FILENO, none, sizeof(none) - 1);
+        (void)ignored;
+    }
+}
+
+// FUNCTION: install the SIGUSR1 handler for the whole run
+void progress_install() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = progress_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART; // fwrite, reads and the joins go on after a report request
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+/* FUNCTION: report the progress of the segmented sieve
+ * Every PROGRESS_TICK seconds the thread checks whether a report is due or was requested with SIGUSR1,
+ * then sums the segment counters of the workers and prints to stderr the share done, the rate in
+ * numbers per second and the time left at that rate. Reads are relaxed, a count may lag by a segment.
+ */
+void *progress_thread(void *arg) {
+    progress_reporter *r = arg;
+    double next = r->started + r->interval;
+    struct timespec tick = { 0, (long)(PROGRESS_TICK * 1e9) };
+    while (!atomic_load(&r->stop)) {
+        nanosleep(&tick, NULL);
+        double now = now_seconds();
+        if (!progress_requested && (r->interval == 0 || now < next)) {
+            continue;
+        }
+        progress_requested = 0;
+        next = now + r->interval;
+        unsigned long long done = 0;
+        for (size_t t = 0; t < r->threads; t++) {
+            done += atomic_load_explicit(&r->slots[t].segments, memory_order_relaxed);
+        }
+        double elapsed = now - r->started;
+        double rate = (elapsed > 0) ? done / elapsed : 0; // Segments per second
+        double left = (rate > 0) ? (r->total - done) / rate : 0;
+        fprintf(stderr, "Progress: %5.1f%% (%llu of %llu segments), %.3g numbers/s, elapsed %.0f s, ETA %02d:%02d:%02d\n",
+                100.0 * done / r->total, done, r->total, rate * r->segment_bits * 2, elapsed,
+                (int)(left / 3600), (int)(left / 60) % 60, (int)left % 60);
+    }
+    return NULL;
+}
+
+// FUNCTION: count the primes up to limit with the full sieve, returns 0 if the memory is not available
+unsigned long long count_flat(unsigned limit) {
+    if (initialize_sieve(limit) != EXIT_SUCCESS) {
+        return 0;
+    }
+    sieve_of_eratosthenes(limit);
+    unsigned long long count = 0;
+    for (unsigned long long i = 2; i <= limit; i++) {
+        count += (sieve[i] == IS_PRIME);
+    }
+    free_sieve();
+    return count;
+}
+
+// Comparison of doubles for qsort
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Median of n sorted values
+static double sorted_median(const double *v, int n) {
+    return (n % 2 == 1) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* FUNCTION: median of the samples and its 95% confidence interval
+ * The interval is the 2.5th to 97.5th percentile of the medians of BENCH_RESAMPLES bootstrap resamples,
+ * drawn with a fixed seed so that reruns on the same samples give the same interval.
+ */
+void bench_summary(const double *samples, int n, double *median, double *low, double *high) {
+    double sorted[MAX_BENCH_REPS];
+    double resample[MAX_BENCH_REPS];
+    static double medians[BENCH_RESAMPLES];
+    memcpy(sorted, samples, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    *median = sorted_median(sorted, n);
+    uint64_t state = UINT64_C(0x9E3779B97F4A7C15); // xorshift64 state
+    for (int r = 0; r < BENCH_RESAMPLES; r++) {
+        for (int k = 0; k < n; k++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            resample[k] = sorted[state % (uint64_t)n];
+        }
+        qsort(resample, n, sizeof(double), compare_doubles);
+        medians[r] = sorted_median(resample, n);
+    }
+    qsort(medians, BENCH_RESAMPLES, sizeof(double), compare_doubles);
+    *low = medians[BENCH_RESAMPLES * 25 / 1000];
+    *high = medians[BENCH_RESAMPLES * 975 / 1000 - 1];
+}
+
+/* FUNCTION: benchmark the engines
+ * For the limits 1e6, 1e7, ... up to top, every engine variant counts the primes bench_reps times: the
+ * full sieve (while it fits in half the available memory) and the segmented sieve with 32 KiB and
+ * 256 KiB segments on one thread and with 1, 2, 4, ... threads up to the processor count. Counting
+ * leaves out the output, which has its own costs. Reported are the median wall time, primes per second
+ * and sieve bytes per second (bytes of the sieve array or bitmap processed), each with a 95% bootstrap
+ * confidence interval. All variants must find the same number of primes.
+ */
+int run_benchmark(unsigned long long top) {
+    typedef struct {
+        const char *engine;   // Engine name
+        size_t threads;       // Worker threads
+        size_t segment_bytes; // Segment size, 0 for the full sieve
+    } bench_variant;
+    bench_variant variants[2 + 16];
+    size_t variant_count = 0;
+    size_t cpus = detect_cpu_count();
+    variants[variant_count++] = (bench_variant){ "flat", 1, 0 };
+    variants[variant_count++] = (bench_variant){ "segmented", 1, 256u << 10 };
+    for (size_t t = 1; variant_count < 18; t *= 2) {
+        size_t threads = (t < cpus) ? t : cpus;
+        variants[variant_count++] = (bench_variant){ "segmented", threads, SEGMENT_BITS / 8 };
+        if (threads == cpus) {
+            break;
+        }
+    }
+    FILE *csv = NULL;
+    if (file_out != NULL) {
+        csv = fopen(file_out, "w");
+        if (!csv) {
+            fprintf(stderr, "Failed to open file %s for writing\n", file_out);
+            return EXIT_FAILURE;
+        }
+        fprintf(csv, "limit,engine,threads,segment_bytes,reps,primes,median_s,ci_low_s,ci_high_s,"
+                     "primes_per_s,primes_per_s_low,primes_per_s_high,bytes_per_s,bytes_per_s_low,bytes_per_s_high\n");
+    }
+    FILE *json = NULL;
+    if (bench_json != NULL) {
+        json = fopen(bench_json, "w");
+        if (!json) {
+            fprintf(stderr, "Failed to open file %s for writing\n", bench_json);
+            if (csv) {
+                fclose(csv);
+            }
+            return EXIT_FAILURE;
+        }
+        fprintf(json, "{\"benchmark\": \"eratos3\", \"reps\": %d, \"cpus\": %zu, \"results\": [", bench_reps, cpus);
+    }
+    size_t max_results = 20 * variant_count; // Up to 20 powers of ten
+    size_t result_count = 0;
+    bench_result *results = malloc(max_results * sizeof(*results));
+    if (results == NULL) {
+        fprintf(stderr, "Memory allocation failed for the benchmark results\n");
+        if (csv) {
+            fclose(csv);
+        }
+        if (json) {
+            fclose(json);
+        }
+        return EXIT_FAILURE;
+    }
+    printf("%-12s %-10s %7s %8s %12s %24s %12s %12s\n", "limit", "engine", "threads", "segment",
+           "median [s]", "95% CI [s]", "primes/s", "bytes/s");
+    size_t available = detect_available_memory();
+    int status = EXIT_SUCCESS;
+    int first_result = 1;
+    for (unsigned long long n = 1000000; n <= top && status == EXIT_SUCCESS; n *= 10) {
+        unsigned long long expected = 0;
+        for (size_t v = 0; v < variant_count; v++) {
+            bench_variant *var = &variants[v];
+            double bytes;
+            if (var->segment_bytes == 0) {
+                bytes = (double)(n + 1) * sizeof(*sieve);
+                if (n > MAX_LIMIT || bytes > available / 2) {
+                    continue; // The full sieve does not fit
+                }
+            } else {
+                bytes = (double)n / 16; // One bit per odd number
+            }
+            sieve_plan plan = { ENGINE_SEGMENTED, var->segment_bytes, 2 * var->threads, OUTPUT_BUFFER, 0,
+                                var->threads, BLOCK_SEGMENTS, (size_t)prefetch_distance, 0 };
+            double samples[MAX_BENCH_REPS];
+            unsigned long long count = 0;
+            for (int r = -1; r < bench_reps; r++) { // Run -1 warms up caches and page tables and is not kept
+                double start = now_seconds();
+                if (var->segment_bytes == 0) {
+                    count = count_flat((unsigned)n);
+                } else {
+                    prime_sink counter = { NULL, { 0 }, ' ', 1, 0 };
+                    if (sieve_segmented(n, &plan, &counter) != EXIT_SUCCESS) {
+                        status = EXIT_FAILURE;
+                    }
+                    free_base_primes();
+                    count = counter.count;
+                }
+                if (r >= 0) {
+                    samples[r] = now_seconds() - start;
+                }
+            }
+            if (expected == 0) {
+                expected = count;
+            } else if (count != expected) {
+                fprintf(stderr, "Benchmark error: %s with %zu threads counts %llu primes up to %llu, expected %llu\n",
+                        var->engine, var->threads, count, n, expected);
+                status = EXIT_FAILURE;
+            }
+            if (result_count < max_results) {
+                bench_result *res = &results[result_count++];
+                res->limit = n;
+                snprintf(res->engine, sizeof(res->engine), "%s", var->engine);
+                res->threads = var->threads;
+                res->segment_bytes = var->segment_bytes;
+                res->reps = bench_reps;
+                memcpy(res->samples, samples, bench_reps * sizeof(double));
+            }
+            double median, low, high;
+            bench_summary(samples, bench_reps, &median, &low, &high);
+            printf("%-12llu %-10s %7zu %8zu %12.6f %11.6f - %10.6f %12.4g %12.4g\n", n, var->engine, var->threads,
+                   var->segment_bytes, median, low, high, count / median, bytes / median);
+            if (csv) {
+                fprintf(csv, "%llu,%s,%zu,%zu,%d,%llu,%.9f,%.9f,%.9f,%.6g,%.6g,%.6g,%.6g,%.6g,%.6g\n", n, var->engine,
+                        var->threads, var->segment_bytes, bench_reps, count, median, low, high, count / median,
+                        count / high, count / low, bytes / median, bytes / high, bytes / low);
+            }
+            if (json) {
+                fprintf(json, "%s\n  {\"limit\": %llu, \"engine\": \"%s\", \"threads\": %zu, \"segment_bytes\": %zu, "
+                              "\"primes\": %llu, \"median_s\": %.9f, \"ci_low_s\": %.9f, \"ci_high_s\": %.9f, "
+                              "\"primes_per_s\": %.6g, \"bytes_per_s\": %.6g, \"samples\": [",
+                        first_result ? "" : ",", n, var->engine, var->threads, var->segment_bytes, count,
+                        median, low, high, count / median, bytes / median);
+                for (int r = 0; r < bench_reps; r++) {
+                    fprintf(json, "%s%.9f", (r > 0) ? ", " : "", samples[r]);
+                }
+                fprintf(json, "]}");
+                first_result = 0;
+            }
+        }
+        if (n > top / 10) {
+            break; // The next limit would be above top, or wrap around
+        }
+    }
+    if (csv) {
+        fclose(csv);
+        printf("Benchmark results written to %s\n", file_out);
+    }
+    if (json) {
+        fprintf(json, "\n]}\n");
+        fclose(json);
+        printf("Benchmark results written to %s\n", bench_json);
+    }
+    if (baseline_json != NULL && compare_baseline(results, result_count, baseline_json) != EXIT_SUCCESS) {
+        status = EXIT_FAILURE;
+    }
+    free(results);
+    return status;
+}
+
+/* FUNCTION: one-sided Mann-Whitney U test
+ * Returns the p-value for the hypothesis that the current samples tend to be larger (slower) than the
+ * baseline samples, from the normal approximation with continuity and tie correction. It makes no
+ * assumption about the distribution of the times, which are skewed by outliers from other processes.
+ */
+double mann_whitney(const double *base, int nb, const double *cur, int nc) {
+    int total = nb + nc;
+    double values[2 * MAX_BENCH_REPS];
+    double ranks[2 * MAX_BENCH_REPS];
+    memcpy(values, base, nb * sizeof(double));
+    memcpy(values + nb, cur, nc * sizeof(double));
+    double sorted[2 * MAX_BENCH_REPS];
+    memcpy(sorted, values, total * sizeof(double));
+    qsort(sorted, total, sizeof(double), compare_doubles);
+    double ties = 0; // Sum of t^3 - t over groups of t equal values
+    for (int k = 0; k < total;) {
+        int e = k;
+        while (e + 1 < total && sorted[e + 1] == sorted[k]) {
+            e++;
+        }
+        double t = e - k + 1;
+        ties += t * t * t - t;
+        k = e + 1;
+    }
+    // Rank of every value, equal values get the mean of their ranks
+    for (int i = 0; i < total; i++) {
+        int below = 0, equal = 0;
+        for (int k = 0; k < total; k++) {
+            below += (sorted[k] < values[i]);
+            equal += (sorted[k] == values[i]);
+        }
+        ranks[i] = below + (equal + 1) / 2.0;
+    }
+    double rank_sum = 0;
+    for (int i = nb; i < total; i++) {
+        rank_sum += ranks[i];
+    }
+    double u = rank_sum - nc * (nc + 1) / 2.0;
+    double mean = nb * (double)nc / 2;
+    double variance = nb * (double)nc / 12 * ((total + 1) - ties / ((double)total * (total - 1)));
+    if (variance <= 0) {
+        return 1.0; // All samples equal
+    }
+    double z = (u - mean - 0.5) / sqrt(variance);
+    return 0.5 * erfc(z / sqrt(2.0));
+}
+
+// Value of "key": within the JSON object between obj and end, or NULL if it is missing
+static const char *json_value(const char *obj, const char *end, const char *key) {
+    char pattern[40];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(obj, pattern);
+    if (p == NULL || p >= end) {
+        return NULL;
+    }
+    p += strlen(pattern);
+    while (*p == ' ') {
+        p++;
+    }
+    return p;
+}
+
+/* FUNCTION: read benchmark results from a JSON file written by --bench-json
+ * Only that layout is understood: one object per case with limit, engine, threads, segment_bytes and
+ * the samples. Returns the number of cases, 0 if the file cannot be read.
+ */
+size_t load_baseline(const char *path, bench_result **results) {
+    *results = NULL;
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to open baseline %s\n", path);
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *text = (size > 0) ? malloc((size_t)size + 1) : NULL;
+    if (text == NULL || fread(text, 1, (size_t)size, fp) != (size_t)size) {
+        fprintf(stderr, "Failed to read baseline %s\n", path);
+        free(text);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    text[size] = '\0';
+    size_t count = 0;
+    for (const char *p = text; (p = strstr(p, "{\"limit\":")) != NULL; p++) {
+        count++;
+    }
+    *results = calloc(count + 1, sizeof(**results));
+    if (*results == NULL) {
+        free(text);
+        return 0;
+    }
+    size_t loaded = 0;
+    for (const char *obj = strstr(text, "{\"limit\":"); obj != NULL; obj = strstr(obj + 1, "{\"limit\":")) {
+        const char *end = strstr(obj, "]}");
+        const char *limit_at = json_value(obj, end, "limit");
+        const char *engine_at = json_value(obj, end, "engine");
+        const char *threads_at = json_value(obj, end, "threads");
+        const char *segment_at = json_value(obj, end, "segment_bytes");
+        const char *samples_at = json_value(obj, end, "samples");
+        if (end == NULL || !limit_at || !engine_at || !threads_at || !segment_at || !samples_at || *engine_at != '"') {
+            continue; // Not a case written by --bench-json
+        }
+        bench_result *res = &(*results)[loaded];
+        res->limit = strtoull(limit_at, NULL, 10);
+        size_t length = strcspn(engine_at + 1, "\"");
+        if (length >= sizeof(res->engine)) {
+            continue;
+        }
+        memcpy(res->engine, engine_at + 1, length);
+        res->engine[length] = '\0';
+        res->threads = (size_t)strtoull(threads_at, NULL, 10);
+        res->segment_bytes = (size_t)strtoull(segment_at, NULL, 10);
+        res->reps = 0;
+        const char *p = samples_at + 1; // Past the [
+        while (res->reps < MAX_BENCH_REPS && p < end) {
+            char *next;
+            double value = strtod(p, &next);
+            if (next == p) {
+                break;
+            }
+            res->samples[res->reps++] = value;
+            p = next + strspn(next, ", ");
+        }
+        if (res->reps > 0) {
+            loaded++;
+        }
+    }
+    free(text);
+    return loaded;
+}
+
+/* FUNCTION: compare benchmark results with a baseline
+ * Every case of the current run is matched with the baseline case of the same limit, engine, threads and
+ * segment size. A case regresses when its median time grew by more than regress_threshold percent and
+ * the Mann-Whitney U test finds the slowdown significant at REGRESS_ALPHA, so noise alone neither fails
+ * nor passes a run. Prints one line per case and returns EXIT_FAILURE if any case regressed.
+ */
+int compare_baseline(const bench_result *current, size_t count, const char *path) {
+    bench_result *base = NULL;
+    size_t base_count = load_baseline(path, &base);
+    if (base_count == 0) {
+        fprintf(stderr, "No benchmark results found in baseline %s\n", path);
+        free(base);
+        return EXIT_FAILURE;
+    }
+    printf("\nComparison with %s (regression: slower by more than %.1f%% with p < %.2f)\n", path,
+           regress_threshold, REGRESS_ALPHA);
+    printf("%-12s %-10s %7s %8s %12s %12s %9s %9s  %s\n", "limit", "engine", "threads", "segment",
+           "baseline [s]", "current [s]", "change", "p-value", "verdict");
+    size_t regressions = 0, compared = 0;
+    for (size_t i = 0; i < count; i++) {
+        const bench_result *cur = &current[i];
+        const bench_result *old = NULL;
+        for (size_t k = 0; k < base_count && old == NULL; k++) {
+            if (base[k].limit == cur->limit && strcmp(base[k].engine, cur->engine) == 0 &&
+                base[k].threads == cur->threads && base[k].segment_bytes == cur->segment_bytes) {
+                old = &base[k];
+            }
+        }
+        double cur_median, old_median, low, high;
+        bench_summary(cur->samples, cur->reps, &cur_median, &low, &high);
+        if (old == NULL) {
+            printf("%-12llu %-10s %7zu %8zu %12s %12.6f %9s %9s  %s\n", cur->limit, cur->engine, cur->threads,
+                   cur->segment_bytes, "-", cur_median, "-", "-", "new");
+            continue;
+        }
+        compared++;
+        bench_summary(old->samples, old->reps, &old_median, &low, &high);
+        double change = (cur_median / old_median - 1) * 100;
+        double slower = mann_whitney(old->samples, old->reps, cur->samples, cur->reps);
+        double faster = mann_whitney(cur->samples, cur->reps, old->samples, old->reps);
+        const char *verdict = "same";
+        if (change > regress_threshold && slower < REGRESS_ALPHA) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (change < -regress_threshold && faster < REGRESS_ALPHA) {
+            verdict = "improved";
+        }
+        printf("%-12llu %-10s %7zu %8zu %12.6f %12.6f %+8.1f%% %9.4f  %s\n", cur->limit, cur->engine, cur->threads,
+               cur->segment_bytes, old_median, cur_median, change, (change > 0) ? slower : faster, verdict);
+    }
+    free(base);
+    if (regressions > 0) {
+        fprintf(stderr, "Performance regression in %zu of %zu cases\n", regressions, compared);
+        return EXIT_FAILURE;
+    }
+    printf("No performance regression in %zu cases\n", compared);
+    return EXIT_SUCCESS;
+}
+
+// Primes p with lo <= p < hi, at most max of them, found with sieve_odd_segment; base primes up to sqrt(hi) needed
+static size_t collect_primes(uint64_t lo, uint64_t hi, uint32_t *out, size_t max) {
+    uint64_t bits[SEGMENT_BITS / 64];
+    size_t count = 0;
+    for (uint64_t first = lo / 2; 2 * first + 1 < hi && count < max; first += SEGMENT_BITS) {
+        sieve_odd_segment(bits, first, SEGMENT_BITS);
+        for (uint64_t i = 0; i < SEGMENT_BITS && count < max; i++) {
+            uint64_t n = 2 * (first + i) + 1;
+            if (n >= lo && n < hi && n > 2 && (bits[i / 64] & (UINT64_C(1) << (i % 64))) == 0) {
+                out[count++] = (uint32_t)n;
+            }
+        }
+    }
+    return count;
+}
+
+/* FUNCTION: benchmark the cross-off kernels
+ * Every kernel of the segmented sieve is timed alone, without clearing, counting or formatting, over
+ * MICRO_BITS bits cut into segments of 8 KiB to 1 MiB. The prime distributions are controlled:
+ * small    primes 3 to 61 through sieve_medium, several hits per 64-bit word
+ * medium   primes from 67 up to the segment size in bits through sieve_medium
+ * large    primes of 1 to 8 segment sizes through the buckets (sieve_bucket), hits in several segments
+ * once     primes just below 2^32 through the buckets, every one hits once and is dropped
+ * Start offsets come from a fixed seed. The cross-offs are counted beforehand, and the result is the
+ * median time per cross-off over --reps runs with a 95% bootstrap confidence interval.
+ */
+int run_microbench() {
+    static const char *tiers[4] = { "small", "medium", "large", "once" };
+    size_t max_primes = MICRO_MAX_SEGMENT * 8; // More than the primes of any tier
+    uint32_t *primes = malloc(max_primes * sizeof(*primes));
+    uint32_t *starts = malloc(max_primes * sizeof(*starts));
+    medium_prime *medium = malloc(max_primes * sizeof(*medium));
+    uint64_t *bits = malloc(MICRO_MAX_SEGMENT);
+    bucket_block **bucket = calloc(MICRO_BITS / (MICRO_MIN_SEGMENT * 8) + 16, sizeof(*bucket));
+    if (primes == NULL || starts == NULL || medium == NULL || bits == NULL || bucket == NULL ||
+        generate_base_primes(65536) != EXIT_SUCCESS) {
+        fprintf(stderr, "Memory allocation failed for the microbenchmark\n");
+        free(primes);
+        free(starts);
+        free(medium);
+        free(bits);
+        free(bucket);
+        return EXIT_FAILURE;
+    }
+    memset(bits, 0, MICRO_MAX_SEGMENT);
+    FILE *csv = NULL;
+    if (file_out != NULL) {
+        csv = fopen(file_out, "w");
+        if (!csv) {
+            fprintf(stderr, "Failed to open file %s for writing\n", file_out);
+        } else {
+            fprintf(csv, "kernel,segment_bytes,primes,cross_offs,reps,median_ns,ci_low_ns,ci_high_ns\n");
+        }
+    }
+    printf("%-8s %8s %9s %12s %14s %24s\n", "kernel", "segment", "primes", "cross-offs", "median [ns]", "95% CI [ns]");
+    int status = EXIT_SUCCESS;
+    for (size_t bytes = MICRO_MIN_SEGMENT; bytes <= MICRO_MAX_SEGMENT && status == EXIT_SUCCESS; bytes *= 2) {
+        size_t segment_bits = bytes * 8;
+        int shift = __builtin_ctzll(segment_bits);
+        uint64_t run_bits = (MICRO_BITS > 16 * segment_bits) ? MICRO_BITS : 16 * (uint64_t)segment_bits;
+        size_t segments = (size_t)(run_bits >> shift);
+        sieve_plan plan = { ENGINE_SEGMENTED, bytes, 2, OUTPUT_BUFFER, 0, 1, segments, (size_t)prefetch_distance, 0 };
+        sieve_worker w;
+        memset(&w, 0, sizeof(w));
+        w.plan = &plan;
+        pool_init(&w.buckets, sizeof(bucket_block), STAT_BUCKETS);
+        for (int tier = 0; tier < 4 && status == EXIT_SUCCESS; tier++) {
+            size_t count;
+            switch (tier) {
+            case 0: count = collect_primes(3, SMALL_PRIME_MAX, primes, max_primes); break;
+            case 1: count = collect_primes(SMALL_PRIME_MAX, segment_bits, primes, max_primes); break;
+            case 2: count = collect_primes(segment_bits, 8 * (uint64_t)segment_bits, primes, max_primes); break;
+            default: count = collect_primes(UINT64_C(1) << 31, UINT64_C(1) << 32, primes, run_bits / 64); break;
+            }
+            // Start offsets and the cross-offs they lead to over run_bits bits
+            uint64_t state = UINT64_C(0x9E3779B97F4A7C15) + bytes + tier; // xorshift64 state
+            unsigned long long cross_offs = 0;
+            for (size_t k = 0; k < count; k++) {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                starts[k] = (uint32_t)(state % ((tier == 3) ? run_bits : primes[k]));
+                cross_offs += (run_bits - starts[k] + primes[k] - 1) / primes[k];
+            }
+            double samples[MAX_BENCH_REPS];
+            for (int r = 0; r < bench_reps; r++) {
+                double start;
+                if (tier <= 1) {
+                    for (size_t k = 0; k < count; k++) {
+                        medium[k].prime = primes[k];
+                        medium[k].offset = starts[k];
+                    }
+                    start = now_seconds();
+                    for (size_t s = 0; s < segments; s++) {
+                        sieve_medium(bits, segment_bits, medium, count);
+                    }
+                } else {
+                    for (size_t k = 0; k < count && status == EXIT_SUCCESS; k++) {
+                        status = bucket_push(&w, &bucket[starts[k] >> shift], primes[k], starts[k] & (segment_bits - 1));
+                    }
+                    start = now_seconds();
+                    for (size_t s = 0; s < segments && status == EXIT_SUCCESS; s++) {
+                        status = sieve_bucket(&w, bits, bucket, s, shift, run_bits);
+                    }
+                }
+                samples[r] = (now_seconds() - start) * 1e9 / (double)cross_offs;
+            }
+            if (status != EXIT_SUCCESS) {
+                fprintf(stderr, "Memory allocation failed for bucket blocks\n");
+                break;
+            }
+            double median, low, high;
+            bench_summary(samples, bench_reps, &median, &low, &high);
+            printf("%-8s %8zu %9zu %12llu %14.3f %11.3f - %10.3f\n", tiers[tier], bytes, count, cross_offs, median, low, high);
+            if (csv) {
+                fprintf(csv, "%s,%zu,%zu,%llu,%d,%.4f,%.4f,%.4f\n", tiers[tier], bytes, count, cross_offs, bench_reps,
+                        median, low, high);
+            }
+        }
+        pool_free(&w.buckets);
+    }
+    if (csv) {
+        fclose(csv);
+        printf("Microbenchmark results written to %s\n", file_out);
+    }
+    free_base_primes();
+    free(primes);
+    free(starts);
+    free(medium);
+    free(bits);
+    free(bucket);
+    return status;
+}
+
+/* FUNCTION: benchmark the output
+ * The primes up to n are collected once, then written as comma separated text, like the CSV output,
+ * through every combination of formatter and writer into a scratch file in the current directory:
+ * fprintf into a stdio stream, and the digit loop, the digit pair table and the incremental formatter
+ * filling an aligned buffer that is handed to the writer (none, stdio, write, mmap, O_DIRECT) a
+ * megabyte at a time. The writer none measures the formatting alone. The baseline is write_sieve_to_csv
+ * on the full sieve, which is built before its runs. Nothing is synced, so apart from O_DIRECT the
+ * numbers show the cost up to the page cache. Reported are the median MB/s and primes/s.
+ */
+int run_outbench(unsigned long long n) {
+    static const char *formatters[FORMAT_COUNT] = { "fprintf", "digits", "table", "increment" };
+    static const char *writers[WRITER_COUNT] = { "none", "stdio", "write", "mmap", "direct" };
+    if (n > MAX_LIMIT) {
+        fprintf(stderr, "The output benchmark takes limits up to %u\n", MAX_LIMIT);
+        return EXIT_FAILURE;
+    }
+    size_t max_primes = (size_t)prime_count_bound(n) + 16;
+    uint32_t *primes = malloc(max_primes * sizeof(*primes));
+    char *buffer = aligned_alloc(DIRECT_ALIGN, OUTPUT_BUFFER + DIRECT_ALIGN);
+    if (primes == NULL || buffer == NULL || generate_base_primes(isqrt_u64(n)) != EXIT_SUCCESS) {
+        fprintf(stderr, "Memory allocation failed for the output benchmark\n");
+        free(primes);
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+    primes[0] = 2;
+    size_t count = 1 + collect_primes(3, n + 1, primes + 1, max_primes - 1);
+    free_base_primes();
+    FILE *csv = NULL;
+    if (file_out != NULL) {
+        csv = fopen(file_out, "w");
+        if (!csv) {
+            fprintf(stderr, "Failed to open file %s for writing\n", file_out);
+        } else {
+            fprintf(csv, "formatter,writer,primes,bytes,reps,median_s,ci_low_s,ci_high_s,mb_per_s,primes_per_s\n");
+        }
+    }
+    printf("Writing %zu primes up to %llu to %s\n", count, n, OUTBENCH_FILE);
+    printf("%-20s %-7s %12s %24s %10s %12s\n", "formatter", "writer", "median [s]", "95% CI [s]", "MB/s", "primes/s");
+    int status = EXIT_SUCCESS;
+    size_t expected = 0; // Length of the text, the same for every combination
+    for (int f = 0; f <= FORMAT_COUNT && status == EXIT_SUCCESS; f++) {
+        for (int k = 0; k < WRITER_COUNT; k++) {
+            int baseline = (f == FORMAT_COUNT);
+            if ((f == FORMAT_FPRINTF || baseline) && k != WRITER_STDIO) {
+                continue; // These write through their own stream
+            }
+            double samples[MAX_BENCH_REPS];
+            size_t bytes = 0;
+            int available = 1;
+            if (baseline && (initialize_sieve((unsigned)n) != EXIT_SUCCESS)) {
+                break;
+            }
+            if (baseline) {
+                sieve_of_eratosthenes((unsigned)n);
+            }
+            for (int r = 0; r < bench_reps && available; r++) {
+                out_writer wr;
+                double start = now_seconds();
+                if (baseline) {
+                    write_sieve_to_csv(OUTBENCH_FILE, (unsigned)n);
+                } else if (writer_open(&wr, k, OUTBENCH_FILE) != EXIT_SUCCESS) {
+                    available = 0;
+                    break;
+                } else if (f == FORMAT_FPRINTF) {
+                    fprintf(wr.fp, "%u", primes[0]);
+                    for (size_t i = 1; i < count; i++) {
+                        fprintf(wr.fp, ",%u", primes[i]);
+                    }
+                    fprintf(wr.fp, "\n");
+                    writer_close(&wr, NULL, 0);
+                } else {
+                    char digits[20];
+                    size_t length = 0;
+                    uint64_t previous = 0;
+                    size_t used = 0;
+                    int result = EXIT_SUCCESS;
+                    for (size_t i = 0; i < count && result == EXIT_SUCCESS; i++) {
+                        if (used + 22 > OUTPUT_BUFFER) {
+                            size_t whole = used / DIRECT_ALIGN * DIRECT_ALIGN;
+                            result = writer_put(&wr, buffer, whole);
+                            memcpy(buffer, buffer + whole, used - whole); // Below DIRECT_ALIGN bytes
+                            used -= whole;
+                        }
+                        if (i > 0) {
+                            buffer[used++] = ',';
+                        }
+                        used += (f == FORMAT_DIGITS) ? format_u64(buffer + used, primes[i])
+                              : (f == FORMAT_TABLE) ? format_table(buffer + used, primes[i])
+                              : format_increment(buffer + used, primes[i], digits, &length, &previous);
+                    }
+                    buffer[used++] = '\n';
+                    if (writer_close(&wr, buffer, used) != EXIT_SUCCESS || result != EXIT_SUCCESS) {
+                        if (k == WRITER_DIRECT) {
+                            available = 0; // The file system refuses O_DIRECT
+                            break;
+                        }
+                        status = EXIT_FAILURE;
+                    }
+                    bytes = wr.written;
+                }
+                samples[r] = now_seconds() - start;
+            }
+            if (baseline) {
+                free_sieve();
+            }
+            if (!available) {
+                printf("%-20s %-7s %s\n", formatters[f < FORMAT_COUNT ? f : 0], writers[k], "not available on this file system");
+                continue;
+            }
+            struct stat info;
+            if ((f == FORMAT_FPRINTF || baseline) && stat(OUTBENCH_FILE, &info) == 0) {
+                bytes = (size_t)info.st_size;
+            }
+            if (expected == 0) {
+                expected = bytes;
+            } else if (bytes != expected) {
+                fprintf(stderr, "Output benchmark error: %s with %s wrote %zu bytes, expected %zu\n",
+                        baseline ? "write_sieve_to_csv" : formatters[f], writers[k], bytes, expected);
+                status = EXIT_FAILURE;
+            }
+            double median, low, high;
+            bench_summary(samples, bench_reps, &median, &low, &high);
+            const char *name = baseline ? "write_sieve_to_csv" : formatters[f];
+            printf("%-20s %-7s %12.6f %11.6f - %10.6f %10.1f %12.4g\n", name, writers[k], median, low, high,
+                   bytes / median / 1e6, count / median);
+            if (csv) {
+                fprintf(csv, "%s,%s,%zu,%zu,%d,%.9f,%.9f,%.9f,%.2f,%.6g\n", name, writers[k], count, bytes, bench_reps,
+                        median, low, high, bytes / median / 1e6, count / median);
+            }
+        }
+    }
+    unlink(OUTBENCH_FILE);
+    if (csv) {
+        fclose(csv);
+        printf("Output benchmark results written to %s\n", file_out);
+    }
+    free(primes);
+    free(buffer);
+    return status;
+}
+
+// FUNCTION: hash the bitmap of a segment, equal bitmaps give equal digests
+uint64_t segment_digest(const uint64_t *bits, size_t words) {
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+    for (size_t k = 0; k < words; k++) {
+        hash = (hash ^ bits[k]) * UINT64_C(0x100000001B3);
+        hash ^= hash >> 29;
+    }
+    return hash ^ words;
+}
+
+/* FUNCTION: verify the engines
+ * First the number of primes up to every power of ten and every power of two from 2^10 up to top is
+ * counted with the segmented sieve, and with the full sieve while it fits in half the available memory,
+ * and compared with the known values of pi(x). Then the whole range up to top is sieved by the
+ * segmented sieve with the current settings (-t, --segment, --prefetch), which records a digest of every
+ * segment, and each segment is compared with the simple one segment sieve (sieve_odd_segment) and, where
+ * it fits, with the full sieve. Returns EXIT_FAILURE on any difference.
+ */
+int run_verify(unsigned long long top) {
+    static const unsigned long long powers_of_ten[19] = {
+        4ULL, 25ULL, 168ULL, 1229ULL, 9592ULL, 78498ULL, 664579ULL, 5761455ULL, 50847534ULL, 455052511ULL,
+        4118054813ULL, 37607912018ULL, 346065536839ULL, 3204941750802ULL, 29844570422669ULL,
+        279238341033925ULL, 2623557157654233ULL, 24739954287740860ULL, 234057667276344607ULL
+    };
+    static const unsigned long long powers_of_two[31] = { // pi(2^k) for k = 10 to 40
+        172ULL, 309ULL, 564ULL, 1028ULL, 1900ULL, 3512ULL, 6542ULL, 12251ULL, 23000ULL, 43390ULL, 82025ULL,
+        155611ULL, 295947ULL, 564163ULL, 1077871ULL, 2063689ULL, 3957809ULL, 7603553ULL, 14630843ULL,
+        28192750ULL, 54400028ULL, 105097565ULL, 203280221ULL, 393615806ULL, 762939111ULL, 1480206279ULL,
+        2874398515ULL, 5586502348ULL, 10866266172ULL, 21151907950ULL, 41203088796ULL
+    };
+    size_t budget = (memory_budget != 0) ? memory_budget : detect_available_memory();
+    size_t available = detect_available_memory();
+    int saved_stream = stream_output;
+    stream_output = 1; // Always the segmented sieve, the full sieve is checked on its own
+    sieve_plan plan = plan_sieve(top, budget);
+    stream_output = saved_stream;
+    if (plan.engine == ENGINE_NONE) {
+        fprintf(stderr, "Memory budget of %zu bytes is too small, at least %zu bytes are needed\n", budget, plan.memory);
+        return EXIT_FAILURE;
+    }
+    printf("Verifying up to %llu with %zu threads, %zu byte segments and prefetch distance %zu\n", top,
+           plan.threads, plan.segment_bytes, plan.prefetch);
+    int failures = 0;
+
+    // Known values of pi(x)
+    for (int k = 0; k < 19 + 31; k++) {
+        unsigned long long x = (k < 19) ? 1ULL : 1ULL << (k - 19 + 10);
+        for (int e = 0; k < 19 && e <= k; e++) {
+            x *= 10;
+        }
+        unsigned long long known = (k < 19) ? powers_of_ten[k] : powers_of_two[k - 19];
+        if (x > top) {
+            continue;
+        }
+        prime_sink counter = { NULL, { 0 }, ' ', 1, 0 };
+        int status = sieve_segmented(x, &plan, &counter);
+        free_base_primes();
+        int ok = (status == EXIT_SUCCESS && counter.count == known);
+        printf("pi(%llu) = %llu, segmented %llu", x, known, counter.count);
+        if (x <= MAX_LIMIT && (x + 1) * sizeof(*sieve) <= available / 2) {
+            unsigned long long flat = count_flat((unsigned)x);
+            ok = ok && (flat == known);
+            printf(", flat %llu", flat);
+        }
+        printf("  %s\n", ok ? "ok" : "MISMATCH");
+        failures += !ok;
+    }
+
+    // The planner must not overestimate the sieving primes so far that the largest streams are refused
+    stream_output = 1;
+    sieve_plan largest = plan_sieve(MAX_STREAM_LIMIT, VERIFY_PLAN_BUDGET);
+    stream_output = saved_stream;
+    printf("Plan up to %llu: %zu bytes with a budget of %llu bytes  %s\n", MAX_STREAM_LIMIT, largest.memory,
+           VERIFY_PLAN_BUDGET, (largest.engine != ENGINE_NONE) ? "ok" : "MISMATCH");
+    failures += (largest.engine == ENGINE_NONE);
+
+    // Prefix sums of the min_25 sieve against the linear sieve
+    static const char *sum_names[] = { "", "mu(n)", "phi(n)", "d(n)", "sigma(n)" };
+    unsigned long long sum_top = (top < LINEAR_CHECK_LIMIT) ? top : LINEAR_CHECK_LIMIT;
+    for (int fn = SUM_MU; fn <= SUM_SIGMA; fn++) {
+        wide_t sum = 0;
+        wide_t check = 0;
+        char buf[41];
+        char check_buf[41];
+        int ok = (prefix_sum_min25(fn, sum_top, &sum) == EXIT_SUCCESS);
+        free_base_primes();
+        ok = ok && prefix_sum_linear(fn, sum_top, &check) == EXIT_SUCCESS && sum == check;
+        printf("Sum of %s up to %llu = %s, linear sieve %s  %s\n", sum_names[fn], sum_top, format_wide(sum, buf),
+               format_wide(check, check_buf), ok ? "ok" : "MISMATCH");
+        failures += !ok;
+    }
+
+    // Segment by segment against the simple segment sieve and the full sieve
+    uint64_t segment_bits = (uint64_t)plan.segment_bytes * 8;
+    uint64_t end = (top - 1) / 2 + 1; // One past the index of the largest odd number up to top
+    size_t segments = (size_t)((end + segment_bits - 1) / segment_bits);
+    verify_digests = calloc(segments, sizeof(*verify_digests));
+    uint64_t *bits = malloc(plan.segment_bytes);
+    if (verify_digests == NULL || bits == NULL) {
+        fprintf(stderr, "Memory allocation failed for the segment digests\n");
+        free(verify_digests);
+        verify_digests = NULL;
+        free(bits);
+        return EXIT_FAILURE;
+    }
+    prime_sink counter = { NULL, { 0 }, ' ', 1, 0 };
+    if (sieve_segmented(top, &plan, &counter) != EXIT_SUCCESS) {
+        failures++;
+    }
+    int flat = (top <= MAX_LIMIT && (top + 1) * sizeof(*sieve) <= available / 2 &&
+                initialize_sieve((unsigned)top) == EXIT_SUCCESS);
+    if (flat) {
+        sieve_of_eratosthenes((unsigned)top);
+    }
+    size_t mismatches = 0;
+    for (size_t s = 0; s < segments; s++) {
+        uint64_t first = s * segment_bits;
+        size_t nbits = (end - first < segment_bits) ? (size_t)(end - first) : (size_t)segment_bits;
+        size_t words = (nbits + 63) / 64;
+        sieve_odd_segment(bits, first, nbits); // Base primes are still those of the segmented run
+        int same = (segment_digest(bits, words) == verify_digests[s]);
+        if (flat) {
+            // The same bitmap from the full sieve, bits past nbits crossed out as in the segments
+            memset(bits, 0xFF, words * sizeof(uint64_t));
+            for (size_t i = 0; i < nbits; i++) {
+                if (sieve[2 * (first + i) + 1] == IS_PRIME) {
+                    bits[i / 64] &= ~(UINT64_C(1) << (i % 64));
+                }
+            }
+            same = same && (segment_digest(bits, words) == verify_digests[s]);
+        }
+        if (!same) {
+            if (mismatches < VERIFY_REPORT) {
+                printf("Segment %zu (%llu to %llu) differs between the engines\n", s,
+                       (unsigned long long)(2 * first + 1), (unsigned long long)(2 * (first + nbits - 1) + 1));
+            }
+            mismatches++;
+        }
+    }
+    if (flat) {
+        free_sieve();
+    }
+    free_base_primes();
+    free(verify_digests);
+    verify_digests = NULL;
+    free(bits);
+    printf("%zu segments compared with the one segment sieve%s: %zu differ\n", segments,
+           flat ? " and the full sieve" : "", mismatches);
+    if (failures > 0 || mismatches > 0) {
+        fprintf(stderr, "Verification failed\n");
+        return EXIT_FAILURE;
+    }
+    printf("Verification passed\n");
+    return EXIT_SUCCESS;
+}
+
+/* FUNCTION: list the processors for pinned workers
+ * The processors this process may run on, in order. Without smt only the first hardware thread of
+ * every core is kept, as read from the thread siblings in sysfs. Returns the number of processors.
+ */
+size_t select_cpus(int *cpus, size_t max, int smt) {
+    cpu_set_t allowed;
+    size_t count = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return 0;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        if (!smt) {
+            char path[96];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+            FILE *fp = fopen(path, "r");
+            int sibling = cpu;
+            if (fp != NULL) {
+                if (fscanf(fp, "%d", &sibling) != 1) {
+                    sibling = cpu;
+                }
+                fclose(fp);
+            }
+            if (sibling != cpu) {
+                continue; // A second hardware thread of a core already in the list
+            }
+        }
+        cpus[count++] = cpu;
+    }
+    return count;
+}
+
+/* FUNCTION: measure the speedup over the thread count
+ * The primes up to n are counted --reps times with 1, 2, 4, ... threads up to the processor count (or
+ * the pinned processors), always ending with the full count. Reported per thread count are the median
+ * time, the speedup over one thread, the parallel efficiency (speedup per thread) and an estimate of
+ * the memory traffic: every segment bitmap is written once and every bucket entry is written and read
+ * once. With --counters the traffic seen by the last level cache (misses times 64 bytes) is shown too.
+ */
+int run_scaling(unsigned long long n) {
+    size_t cpus = (pin_count > 0) ? pin_count : detect_cpu_count();
+    size_t budget = (memory_budget != 0) ? memory_budget : detect_available_memory();
+    FILE *csv = NULL;
+    if (file_out != NULL) {
+        csv = fopen(file_out, "w");
+        if (!csv) {
+            fprintf(stderr, "Failed to open file %s for writing\n", file_out);
+            return EXIT_FAILURE;
+        }
+        fprintf(csv, "threads,pinned,median_s,ci_low_s,ci_high_s,speedup,efficiency,traffic_gb_per_s,llc_gb_per_s\n");
+    }
+    printf("Scaling up to %llu on %zu processors%s%s\n", n, cpus, (pin_count > 0) ? ", pinned" : "",
+           skip_smt ? ", one thread per core" : "");
+    printf("%7s %12s %24s %8s %10s %14s %12s\n", "threads", "median [s]", "95% CI [s]", "speedup", "efficiency",
+           "traffic GB/s", "LLC GB/s");
+    int status = EXIT_SUCCESS;
+    double single = 0;
+    unsigned long long expected = 0;
+    for (size_t threads = 1; status == EXIT_SUCCESS; threads = (2 * threads < cpus) ? 2 * threads : cpus) {
+        int saved_threads = thread_count;
+        int saved_stream = stream_output;
+        thread_count = (int)threads;
+        stream_output = 1;
+        sieve_plan plan = plan_sieve(n, budget);
+        thread_count = saved_threads;
+        stream_output = saved_stream;
+        if (plan.engine == ENGINE_NONE || plan.threads != threads) {
+            fprintf(stderr, "Memory budget too small for %zu threads\n", threads);
+            break;
+        }
+        double samples[MAX_BENCH_REPS];
+        unsigned long long buckets = 0, llc = 0;
+        for (int r = -1; r < bench_reps && status == EXIT_SUCCESS; r++) { // Run -1 warms up and is not kept
+            unsigned long long buckets_before = bucket_total;
+            unsigned long long llc_before = phase_total[TIME_SIEVE].events[EVENT_LLC_MISSES];
+            prime_sink counter = { NULL, { 0 }, ' ', 1, 0 };
+            double start = now_seconds();
+            status = sieve_segmented(n, &plan, &counter);
+            double elapsed = now_seconds() - start;
+            free_base_primes();
+            if (expected == 0) {
+                expected = counter.count;
+            } else if (counter.count != expected) {
+                fprintf(stderr, "Scaling error: %zu threads count %llu primes, expected %llu\n", threads,
+                        counter.count, expected);
+                status = EXIT_FAILURE;
+            }
+            if (r >= 0) {
+                samples[r] = elapsed;
+                buckets += bucket_total - buckets_before;
+                llc += phase_total[TIME_SIEVE].events[EVENT_LLC_MISSES] - llc_before;
+            }
+        }
+        if (status != EXIT_SUCCESS) {
+            break;
+        }
+        double median, low, high;
+        bench_summary(samples, bench_reps, &median, &low, &high);
+        if (threads == 1) {
+            single = median;
+        }
+        double speedup = single / median;
+        double traffic = ((double)n / 16 + 16.0 * buckets / bench_reps) / median / 1e9;
+        double llc_rate = 64.0 * llc / bench_reps / median / 1e9;
+        printf("%7zu %12.6f %11.6f - %10.6f %8.2f %9.1f%% %14.2f", threads, median, low, high, speedup,
+               100 * speedup / threads, traffic);
+        if (main_counters.opened > 0) {
+            printf(" %12.2f\n", llc_rate);
+        } else {
+            printf(" %12s\n", "-");
+        }
+        if (csv) {
+            fprintf(csv, "%zu,%d,%.9f,%.9f,%.9f,%.4f,%.4f,%.4f,%.4f\n", threads, pin_count > 0, median, low, high,
+                    speedup, speedup / threads, traffic, (main_counters.opened > 0) ? llc_rate : 0.0);
+        }
+        if (threads == cpus) {
+            break;
+        }
+    }
+    if (csv) {
+        fclose(csv);
+        printf("Scaling results written to %s\n", file_out);
+    }
+    return status;
+}
+
+/* FUNCTION: sieve and write the primes up to a small limit
+ * For limits up to FAST_PATH_LIMIT the whole run costs less than planning, mapping and faulting in a
+ * full sieve array, so a byte sieve in static memory is used, whose untouched pages are never faulted
+ * in, and the text goes out through one static buffer. The output is the same as from the full sieve:
+ * on stdout every prime is followed by a space, in a file they are separated by commas.
+ */
+int print_small_primes(unsigned limit, const char *filename) {
+    static unsigned char small[FAST_PATH_LIMIT + 1];
+    static char text[FAST_PATH_TEXT];
+    FILE *fp = stdout;
+    if (filename != NULL) {
+        fp = fopen(filename, "w");
+        if (!fp) {
+            fprintf(stderr, "Failed to open file %s for writing\n", filename);
+            return EXIT_FAILURE;
+        }
+    }
+    for (unsigned i = 2; i * i <= limit; i++) {
+        if (small[i] == IS_PRIME) {
+            for (unsigned j = i * i; j <= limit; j += i) {
+                small[j] = NOT_PRIME; // Mark multiples of i as not prime
+            }
+        }
+    }
+    size_t used = 0;
+    int first = 1;
+    for (unsigned i = 2; i <= limit; i++) {
+        if (small[i] != IS_PRIME) {
+            continue;
+        }
+        if (used + 12 > sizeof(text)) {
+            fwrite(text, 1, used, fp);
+            used = 0;
+        }
+        if (filename != NULL && !first) {
+            text[used++] = ',';
+        }
+        used += format_u64(text + used, i);
+        if (filename == NULL) {
+            text[used++] = ' ';
+        }
+        first = 0;
+    }
+    text[used++] = '\n';
+    fwrite(text, 1, used, fp);
+    if (filename != NULL) {
+        fclose(fp);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* FUNCTION: measure the time to the first output byte and to exit
+ * The program starts itself (/proc/self/exe) --reps times per limit and way of starting, with stdout
+ * and stdin connected to pipes, and takes the time from before fork to the first byte on stdout and to
+ * the end of the child. The ways of starting show where the time goes:
+ * help          only --help, the floor of exec, dynamic linking and stdio
+ * args          -n limit, the file name prompt answered with enter (stdout)
+ * prompts       no arguments, limit and file name answered at the prompts
+ * bind-now      as args with LD_BIND_NOW=1, all symbols resolved at startup instead of on first call
+ * no-fast-path  as args with --no-fast-path, the full sieve with planning and a mapped array
+ * file          -n limit -f file, no prompt, the only output is the final message
+ * Stdout is a pipe, so stdio buffers it fully and the first byte comes with the first full buffer.
+ */
+int run_startup() {
+    static const char *variants[STARTUP_VARIANTS] = { "help", "args", "prompts", "bind-now", "no-fast-path", "file" };
+    static const unsigned long long limits[7] = { 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+    extern char **environ;
+    size_t env_count = 0;
+    while (environ[env_count] != NULL) {
+        env_count++;
+    }
+    char **bind_env = malloc((env_count + 2) * sizeof(*bind_env));
+    if (bind_env == NULL) {
+        fprintf(stderr, "Memory allocation failed for the environment\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(bind_env, environ, env_count * sizeof(*bind_env));
+    bind_env[env_count] = "LD_BIND_NOW=1";
+    bind_env[env_count + 1] = NULL;
+    FILE *csv = NULL;
+    if (file_out != NULL) {
+        csv = fopen(file_out, "w");
+        if (!csv) {
+            fprintf(stderr, "Failed to open file %s for writing\n", file_out);
+            free(bind_env);
+            return EXIT_FAILURE;
+        }
+        fprintf(csv, "limit,variant,reps,first_byte_us,first_byte_low_us,first_byte_high_us,exit_us,exit_low_us,exit_high_us\n");
+    }
+    printf("%-10s %-13s %16s %22s %16s %22s\n", "limit", "variant", "first byte [us]", "95% CI", "exit [us]", "95% CI");
+    int status = EXIT_SUCCESS;
+    for (int l = 0; l < 7 && status == EXIT_SUCCESS; l++) {
+        for (int v = 0; v < STARTUP_VARIANTS && status == EXIT_SUCCESS; v++) {
+            if (v == 0 && l > 0) {
+                continue; // --help does not depend on the limit
+            }
+            char number[24], scratch[] = "eratos3-startup.csv";
+            snprintf(number, sizeof(number), "%llu", limits[l]);
+            char *args[6] = { "eratos3", NULL, NULL, NULL, NULL, NULL };
+            char input[40] = "\n"; // Enter at the file name prompt
+            switch (v) {
+            case 0: args[1] = "--help"; input[0] = '\0'; break;
+            case 2: snprintf(input, sizeof(input), "%s\n\n", number); break;
+            case 4: args[1] = "-n"; args[2] = number; args[3] = "--no-fast-path"; break;
+            case 5: args[1] = "-n"; args[2] = number; args[3] = "-f"; args[4] = scratch; input[0] = '\0'; break;
+            default: args[1] = "-n"; args[2] = number; break;
+            }
+            double first_samples[MAX_BENCH_REPS], exit_samples[MAX_BENCH_REPS];
+            for (int r = -1; r < bench_reps && status == EXIT_SUCCESS; r++) { // Run -1 warms up the page cache
+                int out[2], in[2];
+                if (pipe(out) != 0 || pipe(in) != 0) {
+                    fprintf(stderr, "Failed to create pipes for the startup benchmark\n");
+                    status = EXIT_FAILURE;
+                    break;
+                }
+                fflush(stdout);
+                double start = now_seconds();
+                pid_t pid = fork();
+                if (pid == 0) {
+                    dup2(in[0], STDIN_FILENO);
+                    dup2(out[1], STDOUT_FILENO);
+                    close(in[0]);
+                    close(in[1]);
+                    close(out[0]);
+                    close(out[1]);
+                    execve("/proc/self/exe", args, (v == 3) ? bind_env : environ);
+                    _exit(127);
+                }
+                close(in[0]);
+                close(out[1]);
+                if (pid < 0) {
+                    close(in[1]);
+                    close(out[0]);
+                    fprintf(stderr, "Failed to start the program for the startup benchmark\n");
+                    status = EXIT_FAILURE;
+                    break;
+                }
+                if (input[0] != '\0' && write(in[1], input, strlen(input)) < 0) {
+                    status = EXIT_FAILURE; // The child has gone, reported below
+                }
+                close(in[1]);
+                char buffer[65536];
+                double first = 0;
+                ssize_t got;
+                while ((got = read(out[0], buffer, sizeof(buffer))) > 0) {
+                    if (first == 0) {
+                        first = now_seconds();
+                    }
+                }
+                close(out[0]);
+                int child_status = 0;
+                waitpid(pid, &child_status, 0);
+                double end = now_seconds();
+                int exit_ok = WIFEXITED(child_status) && (v == 0 || WEXITSTATUS(child_status) == EXIT_SUCCESS); // --help exits with EXIT_HELP
+                if (!exit_ok || first == 0) {
+                    fprintf(stderr, "Startup benchmark: %s run for %s failed\n", variants[v], number);
+                    status = EXIT_FAILURE;
+                    break;
+                }
+                if (r >= 0) {
+                    first_samples[r] = (first - start) * 1e6;
+                    exit_samples[r] = (end - start) * 1e6;
+                }
+            }
+            unlink(scratch);
+            if (status != EXIT_SUCCESS) {
+                break;
+            }
+            double first_median, first_low, first_high, exit_median, exit_low, exit_high;
+            bench_summary(first_samples, bench_reps, &first_median, &first_low, &first_high);
+            bench_summary(exit_samples, bench_reps, &exit_median, &exit_low, &exit_high);
+            printf("%-10s %-13s %16.0f %10.0f - %9.0f %16.0f %10.0f - %9.0f\n", (v == 0) ? "-" : number, variants[v],
+                   first_median, first_low, first_high, exit_median, exit_low, exit_high);
+            if (csv) {
+                fprintf(csv, "%s,%s,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", (v == 0) ? "" : number, variants[v], bench_reps,
+                        first_median, first_low, first_high, exit_median, exit_low, exit_high);
+            }
+        }
+    }
+    if (csv) {
+        fclose(csv);
+        printf("Startup results written to %s\n", file_out);
+    }
+    free(bind_env);
+    return status;
+}
+
+/* FUNCTION: choose the engine for the query
+ * Every query gets the engine that answers it fastest within the memory budget:
+ * - lists up to FAST_PATH_LIMIT use the small sieve in static memory, larger ones the full or the
+ *   segmented sieve as planned by plan_sieve; ranges always use the segmented sieve, which can start
+ *   anywhere, and safe and Sophie Germain primes their paired bitmaps
+ * - counts use the prime counting function, O(x^(3/4) / log x) steps, unless sieving the range with
+ *   all threads is estimated to be faster, as for short ranges high up, or its tables do not fit
+ * - the n-th prime counts the primes up to an estimate of it and sieves the window in between, the
+ *   first FAST_PATH_PRIMES primes come from a small sieve
+ * - a single number is tested with Miller-Rabin
+ * The budget is only read when a large engine is considered, small queries start right away.
+ */
+sieve_plan plan_query(unsigned long long limit) {
+    sieve_plan plan = { ENGINE_NONE, SEGMENT_BITS / 8, 2, OUTPUT_BUFFER, 0, 1, BLOCK_SEGMENTS, (size_t)prefetch_distance, range_low };
+    if (query == QUERY_IS_PRIME) {
+        plan.engine = ENGINE_TEST;
+        return plan;
+    }
+    if (query == QUERY_NTH && query_number <= FAST_PATH_PRIMES) {
+        plan.engine = ENGINE_SMALL;
+        plan.memory = FAST_PATH_LIMIT + 1 + FAST_PATH_PRIMES * sizeof(*base_primes);
+        return plan;
+    }
+    if (query == QUERY_LIST && fast_path && prime_mode == MODE_PRIMES && !stream_output && limit <= FAST_PATH_LIMIT && range_low <= 2) {
+        plan.engine = ENGINE_SMALL;
+        plan.memory = FAST_PATH_LIMIT + 1 + FAST_PATH_TEXT;
+        return plan;
+    }
+    size_t budget = (memory_budget != 0) ? memory_budget : detect_available_memory();
+    if (query == QUERY_NTH) {
+        uint64_t x = (uint64_t)(query_number * (log((double)query_number) + log(log((double)query_number)))); // Above the prime
+        plan.memory = 2 * (isqrt_u64(x) + 2) * sizeof(uint64_t) + isqrt_u64(2 * x) + 1 + plan.segment_bytes;
+        plan.engine = (plan.memory <= budget) ? ENGINE_WINDOW : ENGINE_NONE;
+        return plan;
+    }
+    if (query == QUERY_BITMAP) {
+        uint64_t root = isqrt_u64(limit);
+        uint64_t bits = (limit - 1) / 2 + 1 - range_low / 2;
+        plan.engine = ENGINE_BITMAP;
+        plan.threads = (thread_count > 0) ? (size_t)thread_count : detect_cpu_count();
+        plan.segment_bytes = (segment_size >= DIRECT_ALIGN) ? segment_size / DIRECT_ALIGN * DIRECT_ALIGN : BITMAP_SEGMENT;
+        for (;;) {
+            size_t index = (size_t)(bits / (plan.segment_bytes * 8) + 2) * sizeof(uint64_t);
+            plan.memory = (size_t)(root + 1) + (size_t)(prime_count_bound(root) + 1) * sizeof(*base_primes) + index
+                        + 2 * plan.threads * plan.segment_bytes;
+            if (plan.memory <= budget) {
+                break;
+            } else if (plan.threads > 1) {
+                plan.threads--;
+            } else if (plan.segment_bytes > DIRECT_ALIGN) {
+                plan.segment_bytes /= 2; // Stays a multiple of DIRECT_ALIGN
+            } else {
+                plan.engine = ENGINE_NONE;
+                break;
+            }
+        }
+        plan.buffers = 2 * plan.threads;
+        return plan;
+    }
+    sieve_plan sieved = plan_sieve(limit, budget);
+    sieved.low = range_low;
+    if (query == QUERY_COUNT) {
+        size_t pi_memory = 2 * (isqrt_u64(limit) + 2) * sizeof(uint64_t) + isqrt_u64(limit) + 1;
+        double pi_seconds = (prime_count_steps(limit) + ((range_low > 2) ? prime_count_steps(range_low - 1) : 0)) * PI_NS * 1e-9;
+        double sieve_seconds = (double)((limit > sieved.low) ? limit - sieved.low : 0) * SIEVE_NS * 1e-9 / (double)sieved.threads;
+        if (pi_memory <= budget && (pi_seconds < sieve_seconds || sieved.engine == ENGINE_NONE)) {
+            plan.engine = ENGINE_PI;
+            plan.memory = pi_memory;
+            return plan;
+        }
+        if (sieved.engine == ENGINE_NONE && pi_memory < sieved.memory) {
+            sieved.memory = pi_memory; // The least either engine needs
+        }
+        return sieved;
+    }
+    if (prime_mode != MODE_PRIMES && sieved.engine != ENGINE_NONE) {
+        sieved.engine = ENGINE_PAIRED;
+        sieved.threads = 1;
+        sieved.memory = 4 * (SEGMENT_BITS / 8) + sieved.output_buffer + isqrt_u64(2 * limit + 1) * 5; // Bitmaps, buffer, base primes
+    }
+    return sieved;
+}
+
+/* FUNCTION: print the plan of a query
+ * Shows what was asked, the resources the plan was made for, the engine with its threads, segments
+ * and wheel, the memory it needs and where the output goes. For counts both estimated times are
+ * shown, as they decide between the prime counting function and the sieve.
+ */
+void explain_plan(const sieve_plan *plan, unsigned long long limit) {
+    static const char *engines[] = { "none, nothing fits in the memory budget", "full sieve, one array of all numbers",
+                                     "segmented sieve, worker threads sieve blocks of bitmap segments",
+                                     "small sieve in static memory", "paired segmented bitmaps of p and 2p+1",
+                                     "prime counting function (Lucy), no sieve over the range",
+                                     "prime counting function up to an estimate, then a sieve of the window",
+                                     "deterministic Miller-Rabin with 7 bases",
+                                     "bitmap file, worker threads sieve segments that are written in order" };
+    const resource_limits *res = detect_resources();
+    size_t budget = (memory_budget != 0) ? memory_budget : detect_available_memory();
+    unsigned long long low = (plan->low > 2) ? plan->low : 2;
+    printf("Query     : ");
+    if (query == QUERY_IS_PRIME) {
+        printf("is %llu prime\n", query_number);
+    } else if (query == QUERY_NTH) {
+        printf("prime number %llu\n", query_number);
+    } else if (query == QUERY_COUNT) {
+        printf("count the primes from %llu to %llu\n", low, limit);
+    } else if (query == QUERY_BITMAP) {
+        printf("bitmap of the odd numbers from %llu to %llu\n", (unsigned long long)(2 * (plan->low / 2) + 1), limit);
+    } else {
+        const char *what = (prime_mode == MODE_SAFE) ? "safe primes" : (prime_mode == MODE_GERMAIN) ? "Sophie Germain primes" : "primes";
+        printf("list the %s from %llu to %llu\n", what, low, limit);
+    }
+    printf("Resources : %zu processors, memory budget %zu bytes%s\n", res->cpus, budget, (memory_budget != 0) ? " (-m)" : "");
+    printf("Engine    : %s\n", engines[plan->engine]);
+    if (plan->engine == ENGINE_FLAT || plan->engine == ENGINE_SMALL) {
+        printf("Wheel     : none, every number has an entry\n");
+    } else if (plan->engine == ENGINE_SEGMENTED || plan->engine == ENGINE_PAIRED || plan->engine == ENGINE_WINDOW
+               || plan->engine == ENGINE_BITMAP) {
+        printf("Wheel     : odd numbers only, one bit each\n");
+    }
+    if (plan->engine == ENGINE_BITMAP) {
+        printf("Threads   : %zu, %zu segments in flight\n", plan->threads, plan->buffers);
+        printf("Segments  : %zu bytes, one index entry each\n", plan->segment_bytes);
+    }
+    if (plan->engine == ENGINE_SEGMENTED) {
+        printf("Threads   : %zu, %zu blocks in flight\n", plan->threads, plan->buffers);
+        printf("Segments  : %zu bytes, %zu per block, prefetch distance %zu\n", plan->segment_bytes, plan->block_segments, plan->prefetch);
+    }
+    if (plan->engine == ENGINE_NONE) {
+        printf("Memory    : at least %zu bytes needed, above the budget of %zu bytes\n", plan->memory, budget);
+    } else if (plan->engine != ENGINE_TEST) {
+        printf("Memory    : about %zu bytes\n", plan->memory);
+    }
+    if (query == QUERY_COUNT) {
+        double pi_seconds = (prime_count_steps(limit) + ((low > 2) ? prime_count_steps(low - 1) : 0)) * PI_NS * 1e-9;
+        size_t threads = (plan->engine == ENGINE_SEGMENTED) ? plan->threads : detect_cpu_count();
+        printf("Estimate  : counting function %.3g s, sieve %.3g s on %zu threads\n", pi_seconds,
+               (double)(limit - low) * SIEVE_NS * 1e-9 / (double)threads, threads);
+    }
+    if (plan->engine == ENGINE_NONE) {
+        return; // Nothing is written
+    }
+    if (query == QUERY_BITMAP) {
+        uint64_t bits = (limit - 1) / 2 + 1 - plan->low / 2;
+        uint64_t segments = (bits + plan->segment_bytes * 8 - 1) / (plan->segment_bytes * 8);
+        uint64_t data_offset = (sizeof(bitmap_header) + (segments + 1) * sizeof(uint64_t) + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+        printf("Output    : %s, %llu bytes of header and index, then %llu bytes of bitmap, preallocated and written in order\n",
+               bitmap_file, (unsigned long long)data_offset, (unsigned long long)((bits + 63) / 64 * 8));
+        printf("            in aligned blocks of %zu bytes with O_DIRECT where the file system allows it\n", plan->segment_bytes);
+    } else if (query != QUERY_LIST) {
+        printf("Output    : one line on standard output%s%s\n", (file_out != NULL) ? ", also written to " : "", (file_out != NULL) ? file_out : "");
+    } else if (file_out == NULL) {
+        printf("Output    : standard output, or the file named at the prompt\n");
+    } else if (plan->engine == ENGINE_SEGMENTED) {
+        printf("Output    : %s, text chunks formatted by the workers, written in order with fwrite through a %zu byte buffer\n",
+               file_out, plan->output_buffer);
+    } else if (plan->engine == ENGINE_SMALL) {
+        printf("Output    : %s, written from one %d byte text buffer\n", file_out, FAST_PATH_TEXT);
+    } else {
+        printf("Output    : %s, fprintf per prime through a %zu byte buffer\n", file_out, plan->output_buffer);
+    }
+}
+
+/* FUNCTION: answer a count, n-th prime or primality query
+ * Prints the answer on one line and with -f also writes it to the file as CSV: limit and count (low,
+ * limit and count for a range), n and the n-th prime, or the number and 1 if it is prime, else 0.
+ */
+int run_query(const sieve_plan *plan, unsigned long long limit) {
+    char line[96];
+    int status = EXIT_SUCCESS;
+    if (query == QUERY_IS_PRIME) {
+        int prime = is_prime_u64(query_number);
+        printf("%llu is %s\n", query_number, prime ? "prime" : "not prime");
+        snprintf(line, sizeof(line), "%llu,%d", query_number, prime);
+    } else if (query == QUERY_NTH) {
+        uint64_t prime = 0;
+        if (nth_prime(query_number, &prime) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        printf("Prime number %llu is %llu\n", query_number, (unsigned long long)prime);
+        snprintf(line, sizeof(line), "%llu,%llu", query_number, (unsigned long long)prime);
+    } else {
+        uint64_t count = 0;
+        if (plan->engine == ENGINE_PI) {
+            uint64_t below = 0;
+            phase_mark started = take_mark(&main_counters);
+            status = prime_count(limit, &count);
+            if (status == EXIT_SUCCESS && plan->low > 2) {
+                status = prime_count(plan->low - 1, &below);
+            }
+            timing_add(TIME_SIEVE, &started);
+            count = (count > below) ? count - below : 0; // No primes in an empty range
+        } else {
+            prime_sink sink = { NULL, { 0 }, ' ', 1, 0 }; // Counting sink, the workers only count
+            status = sieve_segmented(limit, plan, &sink);
+            free_base_primes();
+            count = sink.count;
+        }
+        if (status != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (plan->low > 2) {
+            printf("Number of primes from %llu to %llu: %llu\n", (unsigned long long)plan->low, limit, (unsigned long long)count);
+            snprintf(line, sizeof(line), "%llu,%llu,%llu", (unsigned long long)plan->low, limit, (unsigned long long)count);
+        } else {
+            printf("Number of primes up to %llu: %llu\n", limit, (unsigned long long)count);
+            snprintf(line, sizeof(line), "%llu,%llu", limit, (unsigned long long)count);
+        }
+    }
+    if (file_out != NULL) {
+        FILE *fp = fopen(file_out, "w");
+        if (!fp) {
+            fprintf(stderr, "Failed to open file %s for writing\n", file_out);
+            return EXIT_FAILURE;
+        }
+        fprintf(fp, "%s\n", line);
+        fclose(fp);
+        printf("Result written to %s\n", file_out);
+    }
+    printf("Program completed successfully.\n");
+    return status;
+}
+
+// FUNCTION: estimate the steps of prime_count for x, as measured for x from 1e6 to 1e12
+double prime_count_steps(uint64_t x) {
+    return (x < 16) ? 1 : PI_STEPS * pow((double)x, 0.75) / log((double)x);
+}
+
+/* FUNCTION: count the primes up to x without sieving them
+ * Lucy's method: S(v) starts as the count of 2..v for every value v = x / i, and for each prime p up
+ * to the square root the numbers with smallest prime factor p are removed,
+ * S(v) -= S(v / p) - S(p - 1) for v >= p * p. Only the about 2 sqrt(x) distinct values of x / i are
+ * needed, small ones indexed by v and large ones by x / v.
+ */
+int prime_count(uint64_t x, uint64_t *count) {
+    if (x < 2) {
+        *count = 0;
+        return EXIT_SUCCESS;
+    }
+    uint64_t root = isqrt_u64(x);
+    uint64_t *small = malloc((root + 2) * sizeof(*small)); // small[v] = S(v)
+    uint64_t *large = malloc((root + 2) * sizeof(*large)); // large[i] = S(x / i)
+    if (small == NULL || large == NULL) {
+        fprintf(stderr, "Memory allocation failed for the prime counting tables\n");
+        free(small);
+        free(large);
+        return EXIT_FAILURE;
+    }
+    stats_alloc(STAT_SUMS, 2 * (root + 2) * sizeof(*small));
+    small[0] = 0;
+    for (uint64_t v = 1; v <= root; v++) {
+        small[v] = v - 1;
+        large[v] = x / v - 1;
+    }
+    for (uint64_t p = 2; p <= root; p++) {
+        if (small[p] == small[p - 1]) {
+            continue; // Not prime
+        }
+        uint64_t below = small[p - 1];
+        uint64_t square = p * p;
+        uint64_t last = (x / square < root) ? x / square : root;
+        for (uint64_t i = 1; i <= last; i++) {
+            uint64_t d = i * p;
+            large[i] -= ((d <= root) ? large[d] : small[x / d]) - below;
+        }
+        for (uint64_t v = root; v >= square; v--) {
+            small[v] -= small[v / p] - below;
+        }
+    }
+    *count = large[1];
+    free(small);
+    free(large);
+    stats_free(STAT_SUMS, 2 * (root + 2) * sizeof(*small));
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: logarithmic integral li(x) for x > 1 by the series of Ramanujan
+static double log_integral(double x) {
+    double l = log(x);
+    long double term = 1, sum = 0, inner = 0;
+    for (int n = 1; n < 500; n++) {
+        term = (n == 1) ? l : term * -l / (2.0 * n); // (-1)^(n-1) l^n / (n! 2^(n-1))
+        if (n % 2 == 1) {
+            inner += 1.0L / n; // Sum of 1 / (2k + 1) for k up to (n - 1) / 2
+        }
+        sum += term * inner;
+        if (n > 2 * l && fabsl(term * inner) < 1e-18L * fabsl(sum)) {
+            break;
+        }
+    }
+    return 0.5772156649015329 + log(l) + sqrt(x) * (double)sum;
+}
+
+/* FUNCTION: find the n-th prime
+ * The inverse of li(x) by Newton's method estimates the n-th prime to within about sqrt(x) ln x. The
+ * primes up to the estimate are counted with prime_count, then the segments of odd numbers between
+ * the estimate and the prime are sieved, upwards when the count is short of n and downwards when it
+ * is past it. The first FAST_PATH_PRIMES primes are read from the sieving primes up to FAST_PATH_LIMIT.
+ */
+int nth_prime(uint64_t n, uint64_t *prime) {
+    *prime = 0;
+    if (n <= FAST_PATH_PRIMES) {
+        if (generate_base_primes(FAST_PATH_LIMIT) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        *prime = base_primes[n - 1];
+        free_base_primes();
+        return EXIT_SUCCESS;
+    }
+    double x = (double)n * log((double)n);
+    for (int k = 0; k < 50; k++) {
+        double step = (log_integral(x) - (double)n) * log(x);
+        x -= step;
+        if (fabs(step) < 1) {
+            break;
+        }
+    }
+    uint64_t estimate = (uint64_t)x;
+    uint64_t count = 0;
+    phase_mark started = take_mark(&main_counters);
+    if (prime_count(estimate, &count) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    timing_add(TIME_SIEVE, &started);
+    if (generate_base_primes(isqrt_u64(2 * estimate) + 1) != EXIT_SUCCESS) { // The window stays far below 2x
+        return EXIT_FAILURE;
+    }
+    uint64_t *bits = malloc(SEGMENT_BITS / 8);
+    if (bits == NULL) {
+        fprintf(stderr, "Memory allocation failed for segment\n");
+        free_base_primes();
+        return EXIT_FAILURE;
+    }
+    started = take_mark(&main_counters);
+    size_t words = SEGMENT_BITS / 64;
+    if (count < n) {
+        // Upwards from the first odd number above the estimate until the count reaches n
+        for (uint64_t first = (estimate + 1) / 2; *prime == 0; first += SEGMENT_BITS) {
+            sieve_odd_segment(bits, first, SEGMENT_BITS);
+            for (size_t k = 0; k < words && *prime == 0; k++) {
+                uint64_t word = ~bits[k]; // Set bits are the primes
+                uint64_t primes = (uint64_t)__builtin_popcountll(word);
+                if (count + primes < n) {
+                    count += primes;
+                    continue;
+                }
+                for (; count + 1 < n; count++) {
+                    word &= word - 1; // Skip the primes before the n-th
+                }
+                *prime = 2 * (first + k * 64 + (uint64_t)__builtin_ctzll(word)) + 1;
+            }
+        }
+    } else {
+        // Downwards from the largest odd number up to the estimate, the n-th prime is the (count - n + 1)-th from the top
+        uint64_t from_top = count - n + 1;
+        for (uint64_t end = (estimate - 1) / 2 + 1; *prime == 0; end -= SEGMENT_BITS) {
+            uint64_t first = (end > SEGMENT_BITS) ? end - SEGMENT_BITS : 0;
+            sieve_odd_segment(bits, first, (size_t)(end - first));
+            for (size_t k = (size_t)((end - first + 63) / 64); k-- > 0 && *prime == 0;) {
+                uint64_t word = ~bits[k];
+                uint64_t primes = (uint64_t)__builtin_popcountll(word);
+                if (primes < from_top) {
+                    from_top -= primes;
+                    continue;
+                }
+                for (; from_top > 1; from_top--) {
+                    word &= ~(UINT64_C(1) << (63 - __builtin_clzll(word))); // Skip the primes above the n-th
+                }
+                *prime = 2 * (first + k * 64 + (uint64_t)(63 - __builtin_clzll(word))) + 1;
+            }
+        }
+    }
+    timing_add(TIME_EXTRACT, &started);
+    free(bits);
+    free_base_primes();
+    return EXIT_SUCCESS;
+}
+
+// FUNCTION: a * b mod m without overflow
+static uint64_t mul_mod(uint64_t a, uint64_t b, uint64_t m) {
+    return (uint64_t)((unsigned __int128)a * b % m);
+}
+
+/* FUNCTION: test whether n is prime
+ * Trial division by the primes below 40, then Miller-Rabin with the 7 bases of Jim Sinclair, which
+ * have no strong pseudoprime below 2^64, so the answer is exact for every 64-bit number.
+ */
+int is_prime_u64(uint64_t n) {
+    static const uint64_t small[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+    static const uint64_t bases[] = { 2, 325, 9375, 28178, 450775, 9780504, 1795265022 };
+    if (n < 2) {
+        return 0;
+    }
+    for (size_t k = 0; k < sizeof(small) / sizeof(*small); k++) {
+        if (n % small[k] == 0) {
+            return n == small[k];
+        }
+    }
+    if (n < 41 * 41) {
+        return 1; // No factor up to the square root
+    }
+    uint64_t d = n - 1;
+    int s = __builtin_ctzll(d);
+    d >>= s;
+    for (size_t k = 0; k < sizeof(bases) / sizeof(*bases); k++) {
+        uint64_t a = bases[k] % n;
+        if (a == 0) {
+            continue;
+        }
+        uint64_t y = 1;
+        for (uint64_t e = d, b = a; e != 0; e >>= 1, b = mul_mod(b, b, n)) {
+            if (e & 1) {
+                y = mul_mod(y, b, n);
+            }
+        }
+        if (y == 1 || y == n - 1) {
+            continue;
+        }
+        int composite = 1;
+        for (int r = 1; r < s && composite; r++) {
+            y = mul_mod(y, y, n);
+            composite = (y != n - 1);
+        }
+        if (composite) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* FUNCTION: sieve one segment of the bitmap file
+ * The segment is sieved like the others, crossing out with set bits, then inverted so that the file
+ * has the primes set. The rest of the buffer is cleared, so the last segment can be written as whole
+ * aligned blocks.
+ */
+void *bitmap_segment(void *arg) {
+    bitmap_job *job = arg;
+    double started = now_seconds();
+    sieve_odd_segment(job->bits, job->first, job->nbits);
+    size_t words = (job->nbits + 63) / 64;
+    uint64_t primes = 0;
+    for (size_t k = 0; k < words; k++) {
+        job->bits[k] = ~job->bits[k]; // Bits past the end of the segment were crossed out, so they are 0 now
+        primes += (uint64_t)__builtin_popcountll(job->bits[k]);
+    }
+    memset(job->bits + words, 0, job->bytes - words * sizeof(uint64_t));
+    job->primes = primes;
+    job->seconds = now_seconds() - started;
+    return NULL;
+}
+
+/* FUNCTION: sieve the range into a bitmap file
+ * For bitmaps larger than the memory: the file is preallocated, which also fails early when the disk
+ * is too small, and the bitmap is written after the header and index in segment order, with sequential
+ * writes of whole aligned segments while the workers sieve the next round, as in sieve_segmented. The
+ * writes use O_DIRECT where the file system supports it, so the page cache does not fill up with data
+ * that is not read again. The index holds the number of primes before every segment and the total,
+ * so a reader finds pi(x) or the n-th prime with one lookup and a popcount of one segment. The header
+ * and index are written last, after the data is on disk, so a file with BITMAP_MAGIC is complete.
+ */
+int write_bitmap(const sieve_plan *plan, unsigned long long limit) {
+    uint64_t first = plan->low / 2; // Index of the smallest odd number from low
+    uint64_t end = (limit - 1) / 2 + 1;
+    uint64_t bits = end - first;
+    size_t segment_bytes = plan->segment_bytes;
+    uint64_t segment_bits = (uint64_t)segment_bytes * 8;
+    uint64_t segments = (bits + segment_bits - 1) / segment_bits;
+    uint64_t data_bytes = (bits + 63) / 64 * sizeof(uint64_t);
+    size_t index_bytes = (size_t)(segments + 1) * sizeof(uint64_t);
+    size_t head_bytes = (sizeof(bitmap_header) + index_bytes + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    size_t threads = plan->threads;
+    phase_mark started = take_mark(&main_counters);
+    if (generate_base_primes(isqrt_u64(limit)) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    char *head = calloc(head_bytes, 1); // Header and index
+    bitmap_job *jobs = calloc(2 * threads, sizeof(*jobs)); // Two rounds, one is written while the other is sieved
+    pthread_t *workers = calloc(threads, sizeof(*workers));
+    int status = (head != NULL && jobs != NULL && workers != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+    for (size_t k = 0; status == EXIT_SUCCESS && k < 2 * threads; k++) {
+        jobs[k].bytes = segment_bytes;
+        jobs[k].bits = aligned_alloc(DIRECT_ALIGN, segment_bytes);
+        status = (jobs[k].bits != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (status != EXIT_SUCCESS) {
+        fprintf(stderr, "Memory allocation failed for the bitmap segments\n");
+    }
+    stats_alloc(STAT_SEGMENTS, 2 * threads * segment_bytes);
+    out_writer wr;
+    if (status == EXIT_SUCCESS && writer_open(&wr, WRITER_DIRECT, bitmap_file) != EXIT_SUCCESS
+        && writer_open(&wr, WRITER_WRITE, bitmap_file) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to open file %s for writing\n", bitmap_file);
+        status = EXIT_FAILURE;
+    }
+    if (status == EXIT_SUCCESS) {
+        off_t size = (off_t)(head_bytes + (data_bytes + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN);
+        int error = posix_fallocate(wr.fd, 0, size);
+        if (error == ENOSPC) {
+            fprintf(stderr, "Not enough space for the bitmap file %s of %lld bytes\n", bitmap_file, (long long)size);
+            status = EXIT_FAILURE;
+        } else if (lseek(wr.fd, (off_t)head_bytes, SEEK_SET) < 0) {
+            fprintf(stderr, "Failed to seek in file %s\n", bitmap_file);
+            status = EXIT_FAILURE;
+        }
+        if (status != EXIT_SUCCESS) {
+            writer_close(&wr, NULL, 0);
+            unlink(bitmap_file);
+        }
+    }
+    timing_add(TIME_INIT, &started);
+    if (status != EXIT_SUCCESS) {
+        for (size_t k = 0; jobs != NULL && k < 2 * threads; k++) {
+            free(jobs[k].bits);
+        }
+        stats_free(STAT_SEGMENTS, 2 * threads * segment_bytes);
+        free(jobs);
+        free(workers);
+        free(head);
+        free_base_primes();
+        return EXIT_FAILURE;
+    }
+
+    uint64_t *index = (uint64_t *)(head + sizeof(bitmap_header));
+    uint64_t primes = 0, next = 0; // Primes so far, next segment to sieve
+    size_t round = 0, done = 0; // Jobs of the previous round, in jobs + (round ^ 1) * threads
+    do {
+        bitmap_job *sieving = jobs + round * threads;
+        bitmap_job *writing = jobs + (round ^ 1) * threads;
+        size_t active = 0;
+        for (; status == EXIT_SUCCESS && active < threads && next < segments; active++, next++) {
+            sieving[active].first = first + next * segment_bits;
+            sieving[active].nbits = (size_t)((end - sieving[active].first < segment_bits) ? end - sieving[active].first : segment_bits);
+            if (pthread_create(&workers[active], NULL, bitmap_segment, &sieving[active]) != 0) {
+                bitmap_segment(&sieving[active]); // No thread available, sieve the segment here
+                workers[active] = pthread_self();
+            }
+        }
+        // Write the previous round in order while this round is sieved
+        started = take_mark(&main_counters);
+        size_t written = 0;
+        for (size_t t = 0; t < done && status == EXIT_SUCCESS; t++) {
+            uint64_t s = (writing[t].first - first) / segment_bits;
+            size_t n = (s + 1 < segments) ? segment_bytes
+                     : ((writing[t].nbits + 63) / 64 * sizeof(uint64_t) + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+            errno = 0;
+            if (writer_put(&wr, (const char *)writing[t].bits, n) != EXIT_SUCCESS && wr.kind == WRITER_DIRECT && errno == EINVAL) {
+                fcntl(wr.fd, F_SETFL, fcntl(wr.fd, F_GETFL) & ~O_DIRECT); // The file system refuses O_DIRECT
+                wr.kind = WRITER_WRITE;
+                errno = 0;
+                writer_put(&wr, (const char *)writing[t].bits, n);
+            }
+            if (errno != 0) {
+                fprintf(stderr, "Failed to write the bitmap file %s\n", bitmap_file);
+                status = EXIT_FAILURE;
+            }
+            index[s] = primes;
+            primes += writing[t].primes;
+            written += n;
+        }
+        if (done > 0) {
+            PROBE2(round__write, done, written);
+        }
+        timing_add(TIME_IO, &started);
+        for (size_t t = 0; t < active; t++) {
+            if (!pthread_equal(workers[t], pthread_self())) {
+                pthread_join(workers[t], NULL);
+            }
+            phase_total[TIME_SIEVE].seconds += sieving[t].seconds; // Summed over the threads, as in sieve_segmented
+        }
+        done = active;
+        round ^= 1;
+    } while (done > 0);
+    index[segments] = primes;
+
+    // The data is on disk before the header that declares the file complete
+    started = take_mark(&main_counters);
+    bitmap_header header = { BITMAP_MAGIC, BITMAP_VERSION, sizeof(bitmap_header), 2 * first + 1, limit, bits,
+                             segment_bits, segments, sizeof(bitmap_header), head_bytes, primes };
+    memcpy(head, &header, sizeof(header));
+    fcntl(wr.fd, F_SETFL, fcntl(wr.fd, F_GETFL) & ~O_DIRECT); // The header is written once, no need to align it
+    if (status == EXIT_SUCCESS && (ftruncate(wr.fd, (off_t)(head_bytes + data_bytes)) != 0 || fdatasync(wr.fd) != 0
+        || pwrite(wr.fd, head, head_bytes, 0) != (ssize_t)head_bytes || fdatasync(wr.fd) != 0)) {
+        fprintf(stderr, "Failed to write the bitmap file %s\n", bitmap_file);
+        status = EXIT_FAILURE;
+    }
+    writer_close(&wr, NULL, 0);
+    timing_add(TIME_IO, &started);
+    for (size_t k = 0; k < 2 * threads; k++) {
+        free(jobs[k].bits);
+    }
+    stats_free(STAT_SEGMENTS, 2 * threads * segment_bytes);
+    free(jobs);
+    free(workers);
+    free(head);
+    free_base_primes();
+    if (status != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    printf("Bitmap of %llu odd numbers from %llu to %llu with %llu odd primes written to %s\n", (unsigned long long)bits,
+           (unsigned long long)(2 * first + 1), limit, (unsigned long long)primes, bitmap_file);
+    printf("Program completed successfully.\n");
+    return EXIT_SUCCESS;
+}